@@ -0,0 +1,308 @@
+/*
+ * ProxyBench.cpp - proxied connection benchmark against local SOCKS5 stand-ins
+ * $Id$
+ *
+ * This code is distributed governed by the terms listed in the LICENSE file in
+ * the top directory of this source package.
+ *
+ * (c) 2009 by Georg 'oxff' Wicherski, <gw@mwcollect.org>
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <libnetworkd/Network.hpp>
+#include <libnetworkd/ProxiedNetwork.hpp>
+#include <libnetworkd/LogManager.hpp>
+#include <libnetworkd/TimeoutManager.hpp>
+
+#include "SocksServer.hpp"
+
+
+//! Seconds to wait for handshakes still in progress once all are started.
+#define BENCH_DRAIN_TIME 10
+
+
+namespace libnetworkd
+{
+	LogManager * g_logManager = new LogManager();
+}
+
+using namespace libnetworkd;
+
+
+struct BenchResults
+{
+	BenchResults()
+	{
+		established = 0;
+		failed = 0;
+		lastFinished = 0;
+	}
+
+	//! Handshake latencies in microseconds.
+	std::vector<uint32_t> latencies;
+	uint32_t established;
+	uint32_t failed;
+	uint64_t lastFinished;
+};
+
+
+//! A benchmarked connection, closed as soon as the proxy put it through.
+class BenchConnection : public NetworkEndpoint
+{
+public:
+	BenchConnection(BenchResults * results)
+	{
+		m_results = results;
+		m_socket = 0;
+		m_started = 0;
+		m_finished = false;
+	}
+
+	bool connect(ProxiedNetworkManager * manager, const NetworkNode * target)
+	{
+		m_started = benchMicros();
+
+		if(!(m_socket = manager->connectStream(target, this, true)))
+		{
+			finish(false);
+			return false;
+		}
+
+		return true;
+	}
+
+	virtual void connectionEstablished(NetworkNode * remoteNode, NetworkNode * localNode)
+	{
+		finish(true);
+		m_socket->close(true);
+	}
+
+	virtual void dataRead(const char * buffer, uint32_t dataLength)
+	{ }
+
+	virtual void connectionClosed()
+	{
+		finish(false);
+	}
+
+	//! Finished connections have no socket referring to them anymore.
+	inline bool isFinished()
+	{ return m_finished; }
+
+private:
+	void finish(bool established)
+	{
+		uint64_t now = benchMicros();
+
+		if(m_finished)
+			return;
+
+		m_finished = true;
+		m_results->lastFinished = now;
+
+		if(!established)
+		{
+			++m_results->failed;
+			return;
+		}
+
+		++m_results->established;
+		m_results->latencies.push_back(now - m_started);
+	}
+
+	BenchResults * m_results;
+	NetworkSocket * m_socket;
+	uint64_t m_started;
+	bool m_finished;
+};
+
+
+static void usage(const char * name)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -n count      connections to make (10000)\n"
+		"  -r rate       connections started per second (1000)\n"
+		"  -H hosts      distinct target host names (64)\n"
+		"  -p proxies    local SOCKS5 stand-ins (1)\n"
+		"  -P port       port of the first stand-in (21080)\n"
+		"  -l millis     latency added to each proxy reply (0)\n"
+		"  -f percent    CONNECTs refused by the proxies (0)\n"
+		"  -a            proxies ask for user/password\n"
+		"  -o            send the handshakes optimistically\n"
+		"  -s policy     proxy selection: rr, latency, two, affinity (rr)\n"
+		"  -w sessions   warm sessions to keep (0)\n"
+		"  -t seconds    handshake timeout (0)\n", name);
+}
+
+static double percentile(const std::vector<uint32_t>& sorted, double share)
+{
+	if(sorted.empty())
+		return 0;
+
+	return sorted[(size_t) (share * (sorted.size() - 1))] / 1000.0;
+}
+
+
+int main(int argc, char * argv[])
+{
+	uint32_t count = 10000, rate = 1000, hosts = 64, proxies = 1, port = 21080;
+	uint32_t latency = 0, failurePercent = 0, warmSessions = 0, timeout = 0;
+	bool authenticate = false, optimistic = false;
+	ProxySelection selection = PROXY_ROUND_ROBIN;
+	int option;
+
+	while((option = getopt(argc, argv, "n:r:H:p:P:l:f:aos:w:t:h")) != -1)
+	{
+		switch(option)
+		{
+		case 'n': count = strtoul(optarg, 0, 10); break;
+		case 'r': rate = strtoul(optarg, 0, 10); break;
+		case 'H': hosts = strtoul(optarg, 0, 10); break;
+		case 'p': proxies = strtoul(optarg, 0, 10); break;
+		case 'P': port = strtoul(optarg, 0, 10); break;
+		case 'l': latency = strtoul(optarg, 0, 10); break;
+		case 'f': failurePercent = strtoul(optarg, 0, 10); break;
+		case 'a': authenticate = true; break;
+		case 'o': optimistic = true; break;
+		case 'w': warmSessions = strtoul(optarg, 0, 10); break;
+		case 't': timeout = strtoul(optarg, 0, 10); break;
+
+		case 's':
+			if(!strcmp(optarg, "rr"))
+				selection = PROXY_ROUND_ROBIN;
+			else if(!strcmp(optarg, "latency"))
+				selection = PROXY_LEAST_LATENCY;
+			else if(!strcmp(optarg, "two"))
+				selection = PROXY_TWO_CHOICES;
+			else if(!strcmp(optarg, "affinity"))
+				selection = PROXY_AFFINITY;
+			else
+			{
+				usage(argv[0]);
+				return 1;
+			}
+
+			break;
+
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if(!count || !rate || !hosts || !proxies || port + proxies > 65536)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	TimeoutManager timeoutManager;
+	ProxiedNetworkManager manager;
+	std::vector<SocksServer *> servers;
+	std::vector<BenchConnection *> connections;
+	BenchResults results;
+	uint32_t started = 0, handshakes = 0;
+	uint64_t start, deadline = 0;
+
+	manager.setTimeoutManager(&timeoutManager);
+
+	// the stand-ins share the event loop with the connections they serve
+	for(uint32_t i = 0; i < proxies; ++i)
+	{
+		SocksServer * server = new SocksServer(latency * 1000, failurePercent, authenticate);
+		NetworkNode local;
+		char proxy[64];
+
+		local.name = "127.0.0.1";
+		local.port = port + i;
+
+		if(!manager.serverStream(&local, server, 255))
+		{
+			fprintf(stderr, "cannot listen on 127.0.0.1:%u\n", port + i);
+			return 1;
+		}
+
+		snprintf(proxy, sizeof(proxy), "%s127.0.0.1:%u", authenticate ? "bench:bench@" : "", port + i);
+		manager.addProxy(1, proxy, optimistic);
+		servers.push_back(server);
+	}
+
+	manager.activateSet(1);
+	manager.setSelection(1, selection);
+	manager.setHandshakeTimeout(timeout);
+	manager.setWarmSessions(1, warmSessions);
+
+	start = benchMicros();
+
+	while(results.established + results.failed < count)
+	{
+		uint64_t now = benchMicros();
+		uint32_t due = std::min<uint64_t>(count, (now - start) * rate / 1000000 + 1);
+
+		for(; started < due; ++started)
+		{
+			BenchConnection * connection = new BenchConnection(&results);
+			NetworkNode target;
+			char name[32];
+
+			// names go to the proxy as they are, no resolving on the way
+			snprintf(name, sizeof(name), "target%u.bench", started % hosts);
+			target.name = name;
+			target.port = 80;
+
+			connections.push_back(connection);
+			connection->connect(&manager, &target);
+		}
+
+		if(started == count && !deadline)
+			deadline = now + (BENCH_DRAIN_TIME + timeout) * 1000000ULL;
+
+		if(deadline && now > deadline)
+			break;
+
+		for(std::vector<SocksServer *>::iterator it = servers.begin(); it != servers.end(); ++it)
+			(* it)->sendDelayed(now);
+
+		// below a millisecond apart, connections cannot wait for poll
+		manager.waitForEventsAndProcess(rate > 1000 ? 0 : 1);
+		timeoutManager.fireTimeouts();
+	}
+
+	std::sort(results.latencies.begin(), results.latencies.end());
+
+	for(std::vector<SocksServer *>::iterator it = servers.begin(); it != servers.end(); ++it)
+		handshakes += (* it)->getHandshakes();
+
+	{
+		double seconds = (results.lastFinished > start ? results.lastFinished - start : 1) / 1000000.0;
+
+		printf("connections   %u started, %u established, %u failed, %u unfinished\n", started,
+			results.established, results.failed, started - results.established - results.failed);
+		printf("throughput    %u/s asked, %.1f/s established over %.2f s\n", rate,
+			results.established / seconds, seconds);
+		printf("latency (ms)  min %.3f  p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n",
+			percentile(results.latencies, 0), percentile(results.latencies, 0.5),
+			percentile(results.latencies, 0.9), percentile(results.latencies, 0.99),
+			percentile(results.latencies, 0.999), percentile(results.latencies, 1));
+		printf("proxies       %u CONNECTs put through\n", handshakes);
+	}
+
+	manager.clearProxies();
+
+	for(std::vector<BenchConnection *>::iterator it = connections.begin(); it != connections.end(); ++it)
+	{
+		if((* it)->isFinished())
+			delete * it;
+	}
+
+	return results.established + results.failed < started;
+}
@@ -0,0 +1,233 @@
+/*
+ * SocksServer.cpp - SOCKS5 stand-in for proxy benchmarks
+ * $Id$
+ *
+ * This code is distributed governed by the terms listed in the LICENSE file in
+ * the top directory of this source package.
+ *
+ * (c) 2009 by Georg 'oxff' Wicherski, <gw@mwcollect.org>
+ *
+ */
+
+#include <string.h>
+#include <unistd.h>
+
+#include "SocksServer.hpp"
+
+
+namespace libnetworkd
+{
+
+
+//! One client of the stand-in, parsing its pipelined or step-wise handshake.
+class SocksServerEndpoint : public NetworkEndpoint
+{
+public:
+	SocksServerEndpoint(SocksServer * server, NetworkSocket * socket)
+	{
+		m_server = server;
+		m_socket = socket;
+		m_state = SOCKS_GREETING;
+	}
+
+	virtual void dataRead(const char * buffer, uint32_t dataLength)
+	{
+		if(m_state == SOCKS_TUNNEL)
+		{
+			m_server->reply(m_socket, buffer, dataLength);
+			return;
+		}
+
+		m_input.append(buffer, dataLength);
+
+		// a client sending optimistically has everything in one read
+		while(m_state != SOCKS_TUNNEL && m_state != SOCKS_CLOSING)
+		{
+			uint32_t length = messageLength();
+
+			if(!length || m_input.size() < length)
+				return;
+
+			handleMessage(m_input.data(), length);
+			m_input.erase(0, length);
+		}
+
+		if(m_state == SOCKS_TUNNEL && !m_input.empty())
+		{
+			m_server->reply(m_socket, m_input.data(), m_input.size());
+			m_input.clear();
+		}
+	}
+
+	virtual void connectionClosed()
+	{
+		m_server->forget(m_socket);
+	}
+
+private:
+	enum SocksState
+	{
+		SOCKS_GREETING,
+		SOCKS_AUTHENTICATION,
+		SOCKS_REQUEST,
+		SOCKS_TUNNEL,
+		SOCKS_CLOSING,
+	};
+
+	//! Length of the message in m_input, 0 if that is not known yet.
+	uint32_t messageLength()
+	{
+		const unsigned char * input = (const unsigned char *) m_input.data();
+
+		switch(m_state)
+		{
+		case SOCKS_GREETING:
+			return m_input.size() < 2 ? 0 : 2 + input[1];
+
+		case SOCKS_AUTHENTICATION:
+			if(m_input.size() < 2 || m_input.size() < 3u + input[1])
+				return 0;
+
+			return 3 + input[1] + input[2 + input[1]];
+
+		case SOCKS_REQUEST:
+			if(m_input.size() < 5)
+				return 0;
+
+			if(input[3] == 3)
+				return 4 + 1 + input[4] + 2;
+
+			return 4 + (input[3] == 4 ? 16 : 4) + 2;
+
+		default:
+			return 0;
+		}
+	}
+
+	void handleMessage(const char * message, uint32_t length)
+	{
+		switch(m_state)
+		{
+		case SOCKS_GREETING:
+			{
+				char method = m_server->authenticates() ? 2 : 0;
+				char answer[2] = { 5, method };
+
+				if(message[0] != 5 || !memchr(message + 2, method, length - 2))
+				{
+					answer[1] = (char) 0xff;
+					m_server->reply(m_socket, answer, sizeof(answer), true);
+					m_state = SOCKS_CLOSING;
+					return;
+				}
+
+				m_server->reply(m_socket, answer, sizeof(answer));
+				m_state = method ? SOCKS_AUTHENTICATION : SOCKS_REQUEST;
+				return;
+			}
+
+		case SOCKS_AUTHENTICATION:
+			m_server->reply(m_socket, "\x01\x00", 2);
+			m_state = SOCKS_REQUEST;
+			return;
+
+		case SOCKS_REQUEST:
+			if(message[0] != 5 || message[1] != 1 || m_server->nextFails())
+			{
+				m_server->reply(m_socket, "\x05\x01\x00\x01\x00\x00\x00\x00\x00\x00", 10, true);
+				m_state = SOCKS_CLOSING;
+				return;
+			}
+
+			// we are the target as well, bound to localhost
+			m_server->reply(m_socket, "\x05\x00\x00\x01\x7f\x00\x00\x01\x04\x38", 10);
+			m_server->countHandshake();
+			m_state = SOCKS_TUNNEL;
+			return;
+
+		default:
+			return;
+		}
+	}
+
+	SocksServer * m_server;
+	NetworkSocket * m_socket;
+
+	SocksState m_state;
+	string m_input;
+};
+
+
+SocksServer::SocksServer(uint32_t latency, uint32_t failurePercent, bool authenticate)
+{
+	m_latency = latency;
+	m_failurePercent = failurePercent;
+	m_authenticate = authenticate;
+
+	m_handshakes = 0;
+	m_random = (uint32_t) getpid() | 1;
+}
+
+NetworkEndpoint * SocksServer::createEndpoint(NetworkSocket * clientSocket)
+{
+	return new SocksServerEndpoint(this, clientSocket);
+}
+
+void SocksServer::reply(NetworkSocket * socket, const char * data, uint32_t length, bool close)
+{
+	DelayedReply delayed;
+
+	// closing from within the endpoint would delete it under its feet
+	if(!m_latency && !close)
+	{
+		socket->send(data, length);
+		return;
+	}
+
+	delayed.due = benchMicros() + m_latency;
+	delayed.socket = socket;
+	delayed.data.assign(data, length);
+	delayed.close = close;
+
+	m_delayed.push_back(delayed);
+}
+
+void SocksServer::sendDelayed(uint64_t now)
+{
+	while(!m_delayed.empty() && m_delayed.front().due <= now)
+	{
+		DelayedReply delayed = m_delayed.front();
+
+		m_delayed.pop_front();
+
+		if(!delayed.socket)
+			continue;
+
+		delayed.socket->send(delayed.data.data(), delayed.data.size());
+
+		if(delayed.close)
+			delayed.socket->close();
+	}
+}
+
+void SocksServer::forget(NetworkSocket * socket)
+{
+	for(std::deque<DelayedReply>::iterator it = m_delayed.begin(); it != m_delayed.end(); ++it)
+	{
+		if(it->socket == socket)
+			it->socket = 0;
+	}
+}
+
+bool SocksServer::nextFails()
+{
+	// xorshift, as ProxiedNetworkManager picks its proxies
+	m_random ^= m_random << 13;
+	m_random ^= m_random >> 17;
+	m_random ^= m_random << 5;
+
+	return m_random % 100 < m_failurePercent;
+}
+
+
+}
@@ -0,0 +1,98 @@
+/*
+ * SocksServer.hpp - SOCKS5 stand-in for proxy benchmarks
+ * $Id$
+ *
+ * This code is distributed governed by the terms listed in the LICENSE file in
+ * the top directory of this source package.
+ *
+ * (c) 2009 by Georg 'oxff' Wicherski, <gw@mwcollect.org>
+ *
+ */
+
+#ifndef __INCLUDE_bench_SocksServer_hpp
+#define __INCLUDE_bench_SocksServer_hpp
+
+#include <time.h>
+
+#include <deque>
+
+#include <libnetworkd/Network.hpp>
+
+
+namespace libnetworkd
+{
+
+
+//! Monotonic microseconds, ioTimeMillis is too coarse for handshakes on one box.
+inline uint64_t benchMicros()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+/**
+ * SOCKS5 proxy answering every CONNECT itself instead of connecting anywhere,
+ * echoing what is sent through it afterwards. Its replies can be held back
+ * and its CONNECTs refused at random, to stand in for slow or failing proxies.
+ */
+class SocksServer : public NetworkEndpointFactory
+{
+public:
+	/**
+	 * @param[in]	latency	Microseconds each reply is held back.
+	 * @param[in]	failurePercent	Share of CONNECTs refused with a general failure.
+	 * @param[in]	authenticate	Ask for user/password, any of them is accepted.
+	 */
+	SocksServer(uint32_t latency, uint32_t failurePercent, bool authenticate);
+
+	virtual NetworkEndpoint * createEndpoint(NetworkSocket * clientSocket);
+
+	/**
+	 * Send a reply once the latency passed, closing the socket after it if
+	 * told so. Closing always waits for sendDelayed.
+	 */
+	void reply(NetworkSocket * socket, const char * data, uint32_t length, bool close = false);
+	//! Send the replies due by now, call this as often as the latency demands.
+	void sendDelayed(uint64_t now);
+	//! The socket is gone, drop its replies still held back.
+	void forget(NetworkSocket * socket);
+
+	//! Decide whether to refuse the next CONNECT.
+	bool nextFails();
+
+	inline bool authenticates()
+	{ return m_authenticate; }
+
+	inline uint32_t getHandshakes()
+	{ return m_handshakes; }
+
+	inline void countHandshake()
+	{ ++m_handshakes; }
+
+private:
+	struct DelayedReply
+	{
+		uint64_t due;
+		NetworkSocket * socket;
+		string data;
+		bool close;
+	};
+
+	//! Held back replies, due in the order they were given with a fixed latency.
+	std::deque<DelayedReply> m_delayed;
+
+	uint32_t m_latency;
+	uint32_t m_failurePercent;
+	bool m_authenticate;
+
+	uint32_t m_handshakes;
+	uint32_t m_random;
+};
+
+
+}
+
+#endif // __INCLUDE_bench_SocksServer_hpp
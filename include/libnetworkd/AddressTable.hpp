@@ -0,0 +1,279 @@
+/*
+ * AddressTable.hpp - hash table keyed by binary IPv4 transport addresses
+ * $Id$
+ *
+ * This code is distributed governed by the terms listed in the LICENSE file in
+ * the top directory of this source package.
+ *
+ * (c) 2009 by Georg 'oxff' Wicherski, <gw@mwcollect.org>
+ *
+ */
+
+
+#ifndef __INCLUDE_libnetworkd_AddressTable_hpp
+#define __INCLUDE_libnetworkd_AddressTable_hpp
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#include <new>
+
+
+namespace libnetworkd
+{
+
+
+/**
+ * Open addressing hash table mapping an IPv4 address and port, both as found
+ * in a struct sockaddr_in, to a value. Collisions are resolved by linear
+ * probing and removal shifts entries back instead of leaving tombstones, so
+ * lookups stay short under churn. Lookups never allocate; the table only
+ * grows, doubling once it is half full. Every table hashes with its own
+ * random seed, so peers cannot pick addresses which all collide.
+ *
+ * Values are stored inline and move when the table grows or entries are
+ * removed, so pointers obtained from find or insert are only valid until the
+ * next modification. Value must be copyable.
+ */
+template<class Value> class AddressTable
+{
+public:
+	/**
+	 * Create a new, empty table.
+	 * @param[in]	capacity	Initial number of slots, rounded up to the
+	 *	next power of two.
+	 */
+	AddressTable(uint32_t capacity = 16)
+	{
+		uint32_t size = 8;
+
+		while(size < capacity)
+			size <<= 1;
+
+		m_seed = randomSeed();
+		allocate(size);
+	}
+
+	~AddressTable()
+	{
+		clear();
+		free(m_slots);
+	}
+
+	//! Look up the value associated with the address.
+	inline Value * find(const struct sockaddr_in * address)
+	{
+		uint32_t i = lookup(address);
+
+		return i > m_mask ? 0 : &m_slots[i].value;
+	}
+
+	/**
+	 * Associate a value with the address.
+	 * @return	Pointer to the stored copy or NULL if the address was
+	 *	already present.
+	 */
+	Value * insert(const struct sockaddr_in * address, const Value& value)
+	{
+		uint32_t i;
+
+		if(find(address))
+			return 0;
+
+		if((m_size + 1) * 2 > m_mask + 1)
+			grow();
+
+		for(i = hash(address) & m_mask; m_slots[i].used; i = (i + 1) & m_mask);
+
+		m_slots[i].address = address->sin_addr.s_addr;
+		m_slots[i].port = address->sin_port;
+		m_slots[i].used = true;
+		new(&m_slots[i].value) Value(value);
+
+		++m_size;
+		return &m_slots[i].value;
+	}
+
+	//! Remove the address, returns false if it was not present.
+	bool remove(const struct sockaddr_in * address)
+	{
+		uint32_t i = lookup(address);
+
+		if(i > m_mask)
+			return false;
+
+		removeAt(i);
+		return true;
+	}
+
+	void clear()
+	{
+		for(uint32_t i = 0; i <= m_mask; ++i)
+		{
+			if(m_slots[i].used)
+			{
+				m_slots[i].value.~Value();
+				m_slots[i].used = false;
+			}
+		}
+
+		m_size = 0;
+	}
+
+	inline uint32_t getSize()
+	{ return m_size; }
+
+	/**
+	 * Slots can be enumerated by index from 0 up to getCapacity(). Removing
+	 * the entry at an index with removeAt might move a later entry into it,
+	 * so an enumeration that removes has to check the same index again.
+	 */
+	inline uint32_t getCapacity()
+	{ return m_mask + 1; }
+
+	inline bool isUsed(uint32_t index)
+	{ return m_slots[index].used; }
+
+	inline Value& valueAt(uint32_t index)
+	{ return m_slots[index].value; }
+
+	void removeAt(uint32_t index)
+	{
+		uint32_t hole = index;
+
+		m_slots[hole].value.~Value();
+		m_slots[hole].used = false;
+		--m_size;
+
+		// shift back following entries which would not be found anymore
+		for(uint32_t i = (hole + 1) & m_mask; m_slots[i].used; i = (i + 1) & m_mask)
+		{
+			uint32_t home = hashSlot(m_slots[i]) & m_mask;
+
+			if(((i - home) & m_mask) < ((i - hole) & m_mask))
+				continue;
+
+			m_slots[hole].address = m_slots[i].address;
+			m_slots[hole].port = m_slots[i].port;
+			m_slots[hole].used = true;
+			new(&m_slots[hole].value) Value(m_slots[i].value);
+
+			m_slots[i].value.~Value();
+			m_slots[i].used = false;
+
+			hole = i;
+		}
+	}
+
+private:
+	struct Slot
+	{
+		uint32_t address;
+		uint16_t port;
+		bool used;
+
+		Value value;
+	};
+
+	//! Finalizer of splitmix64, every input bit affects every output bit.
+	static inline uint64_t scramble(uint64_t value)
+	{
+		value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+
+		return value ^ (value >> 31);
+	}
+
+	//! Not to be guessed from outside, tables of one process differ as well.
+	uint64_t randomSeed()
+	{
+		static __thread uint64_t tables = 0;
+		struct timeval now;
+
+		gettimeofday(&now, 0);
+
+		return scramble(((uint64_t) now.tv_sec << 32) ^ now.tv_usec ^ ((uint64_t) getpid() << 20)
+			^ (uintptr_t) this ^ (++tables * 0x9e3779b97f4a7c15ULL));
+	}
+
+	inline uint32_t mix(uint32_t address, uint16_t port)
+	{
+		// the seed goes in before the non-linear rounds, a plain multiply
+		// would keep the distance between two keys' hashes for every seed
+		return (uint32_t) scramble((((uint64_t) address << 16) | port) ^ m_seed);
+	}
+
+	inline uint32_t hash(const struct sockaddr_in * address)
+	{ return mix(address->sin_addr.s_addr, address->sin_port); }
+
+	inline uint32_t hashSlot(const Slot& slot)
+	{ return mix(slot.address, slot.port); }
+
+	//! Index of the address' slot, or beyond m_mask if not present.
+	inline uint32_t lookup(const struct sockaddr_in * address)
+	{
+		for(uint32_t i = hash(address) & m_mask; m_slots[i].used; i = (i + 1) & m_mask)
+		{
+			if(m_slots[i].address == address->sin_addr.s_addr
+				&& m_slots[i].port == address->sin_port)
+			{
+				return i;
+			}
+		}
+
+		return m_mask + 1;
+	}
+
+	void allocate(uint32_t size)
+	{
+		m_slots = (Slot *) calloc(size, sizeof(Slot));
+
+		if(!m_slots)
+			throw std::bad_alloc();
+
+		m_mask = size - 1;
+		m_size = 0;
+	}
+
+	void grow()
+	{
+		Slot * slots = m_slots;
+		uint32_t size = m_mask + 1;
+
+		allocate(size * 2);
+
+		for(uint32_t i = 0; i < size; ++i)
+		{
+			if(slots[i].used)
+			{
+				uint32_t j;
+
+				for(j = hashSlot(slots[i]) & m_mask; m_slots[j].used; j = (j + 1) & m_mask);
+
+				m_slots[j].address = slots[i].address;
+				m_slots[j].port = slots[i].port;
+				m_slots[j].used = true;
+				new(&m_slots[j].value) Value(slots[i].value);
+
+				slots[i].value.~Value();
+				++m_size;
+			}
+		}
+
+		free(slots);
+	}
+
+	Slot * m_slots;
+	uint32_t m_mask;
+	uint32_t m_size;
+
+	uint64_t m_seed;
+};
+
+
+}
+
+#endif // __INCLUDE_libnetworkd_AddressTable_hpp
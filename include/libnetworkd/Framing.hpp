@@ -0,0 +1,201 @@
+/*
+ * Framing.hpp - message framing on top of stream oriented endpoints
+ * $Id$
+ *
+ * This code is distributed governed by the terms listed in the LICENSE file in
+ * the top directory of this source package.
+ *
+ * (c) 2009 by Georg 'oxff' Wicherski, <gw@mwcollect.org>
+ *
+ */
+
+
+#ifndef __INCLUDE_libnetworkd_Framing_hpp
+#define __INCLUDE_libnetworkd_Framing_hpp
+
+#include <stdint.h>
+
+#include "Network.hpp"
+
+
+namespace libnetworkd
+{
+
+
+/**
+ * Byte ring of fixed, power of two capacity. Data is appended at the tail and
+ * consumed from the head; readers can obtain pointers directly into the ring
+ * as long as the requested range does not wrap around its end.
+ */
+class RingBuffer
+{
+public:
+	/**
+	 * Create a new ring.
+	 * @param[in]	capacity	Minimum capacity in bytes, rounded up to the
+	 *	next power of two.
+	 */
+	RingBuffer(uint32_t capacity);
+	~RingBuffer();
+
+	/**
+	 * Append data at the tail of the ring.
+	 * @return	False if there was not enough room, nothing is written then.
+	 */
+	bool write(const char * buffer, uint32_t length);
+
+	/**
+	 * Copy data out of the ring without consuming it.
+	 * @param[in]	offset	Offset relative to the head.
+	 * @param[out]	buffer	Destination of at least length bytes.
+	 * @param[in]	length	Number of bytes to copy, must be available.
+	 */
+	void copy(uint32_t offset, char * buffer, uint32_t length);
+
+	/**
+	 * Obtain a pointer into the ring without copying.
+	 * @param[in]	offset	Offset relative to the head.
+	 * @param[out]	contiguous	Number of bytes readable from the returned
+	 *	pointer before the ring wraps (or the data ends).
+	 */
+	inline const char * peek(uint32_t offset, uint32_t * contiguous)
+	{
+		uint32_t position = (m_head + offset) & m_mask;
+		uint32_t toEnd = m_mask + 1 - position;
+		uint32_t available = m_size - offset;
+
+		* contiguous = available < toEnd ? available : toEnd;
+		return m_buffer + position;
+	}
+
+	//! Drop length bytes from the head.
+	inline void consume(uint32_t length)
+	{
+		m_head = (m_head + length) & m_mask;
+		m_size -= length;
+	}
+
+	inline void clear()
+	{ m_head = m_size = 0; }
+
+	inline uint32_t size()
+	{ return m_size; }
+
+	inline uint32_t capacity()
+	{ return m_mask + 1; }
+
+	inline uint32_t available()
+	{ return m_mask + 1 - m_size; }
+
+	inline bool empty()
+	{ return !m_size; }
+
+private:
+	char * m_buffer;
+	uint32_t m_mask;
+
+	uint32_t m_head;
+	uint32_t m_size;
+};
+
+
+//! Byte order of the length prefix, if framing by length.
+enum FramingByteOrder
+{
+	FRAMING_BIG_ENDIAN,
+	FRAMING_LITTLE_ENDIAN,
+};
+
+//! Maximum length of a delimiter, if framing by delimiter.
+#define FRAMING_MAX_DELIMITER 16
+
+
+/**
+ * Adapter between the raw byte stream of NetworkEndpoint::dataRead and
+ * protocols consisting of discrete messages. Messages are either preceded
+ * by a fixed size length prefix or terminated by a delimiter. Derived classes
+ * implement messageRead instead of dataRead and receive exactly one message
+ * per call, without the prefix or delimiter.
+ *
+ * Messages contained entirely within one read, or contiguous in the internal
+ * ring buffer, are delivered as pointers into that memory. Only messages
+ * wrapping around the end of the ring are copied.
+ */
+class FramedEndpoint : public NetworkEndpoint
+{
+public:
+	/**
+	 * Frame messages by a length prefix, which counts the payload only.
+	 * @param[in]	prefixLength	Size of the prefix, 1, 2 or 4 bytes.
+	 * @param[in]	byteOrder	Byte order of the prefix.
+	 * @param[in]	maximumLength	Larger messages are a framing error.
+	 */
+	FramedEndpoint(uint8_t prefixLength, FramingByteOrder byteOrder,
+		uint32_t maximumLength);
+
+	/**
+	 * Frame messages by a terminating delimiter.
+	 * @param[in]	delimiter	The delimiter, e.g. "\r\n".
+	 * @param[in]	delimiterLength	Length of the delimiter, at most
+	 *	FRAMING_MAX_DELIMITER bytes.
+	 * @param[in]	maximumLength	Larger messages are a framing error.
+	 */
+	FramedEndpoint(const char * delimiter, uint8_t delimiterLength,
+		uint32_t maximumLength);
+
+	virtual ~FramedEndpoint();
+
+	virtual void dataRead(const char * buffer, uint32_t dataLength);
+
+	/**
+	 * Called once for each complete message received. The data is only
+	 * valid for the duration of the call.
+	 * @param[in]	message	Payload of the message.
+	 * @param[in]	length	Length of the payload in bytes.
+	 * @return	True to continue with the next message. Return false if this
+	 *	endpoint might have been destroyed within the call (e.g. because the
+	 *	socket was closed), no member is touched afterwards then.
+	 */
+	virtual bool messageRead(const char * message, uint32_t length) = 0;
+
+	/**
+	 * Called if a message exceeds the maximum length. All buffered input,
+	 * including the rest of the current read, is discarded afterwards. The
+	 * default implementation does nothing, usually you want to close the
+	 * connection here; this endpoint may be destroyed within the call.
+	 */
+	virtual void framingError() { }
+
+protected:
+	//! Frame as many messages as possible from a flat buffer.
+	bool frameBuffer(const char * buffer, uint32_t length, uint32_t * consumed);
+	//! Frame as many messages as possible from the ring buffer.
+	bool frameRing();
+	//! Deliver a message residing in the ring buffer.
+	bool deliverRing(uint32_t offset, uint32_t length);
+
+	//! Find the delimiter in the ring, starting the search at m_scanned.
+	bool findDelimiter(uint32_t * position);
+	inline const char * searchDelimiter(const char * buffer, uint32_t length);
+	uint32_t decodePrefix(const unsigned char * prefix);
+
+private:
+	RingBuffer m_ring;
+	char * m_scratch;
+
+	uint32_t m_maximumLength;
+
+	uint8_t m_prefixLength;
+	FramingByteOrder m_byteOrder;
+
+	char m_delimiter[FRAMING_MAX_DELIMITER];
+	uint8_t m_delimiterLength;
+
+	//! Ring bytes already known not to contain the start of a delimiter.
+	uint32_t m_scanned;
+};
+
+
+}
+
+#endif // __INCLUDE_libnetworkd_Framing_hpp
@@ -13,6 +13,7 @@
 #define __INCLUDE_libnetworkd_IO_hpp
 
 #include <stdint.h>
+#include <time.h>
 
 #include <list>
 using namespace std;
@@ -21,6 +22,26 @@ using namespace std;
 namespace libnetworkd
 {
 
+
+/**
+* Monotonic time in milliseconds. This uses the coarse clock where available,
+* which is cheap enough to be read on every I/O event but only has a
+* resolution of a few milliseconds.
+*/
+inline uint64_t ioTimeMillis()
+{
+	struct timespec now;
+	
+	#ifdef CLOCK_MONOTONIC_COARSE
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	#else
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	#endif
+	
+	return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
 //! The abstract status of a socket as returned by Socket::getStatus.
 enum IOSocketState
 {
@@ -58,6 +79,17 @@ enum IOSocketState
 	* checked, IOSocket:pollError will be called upon error.
 	*/
 	IOSOCKSTAT_BUSY,
+	
+	/**
+	* The socket only wants to get rid of its output, but does not accept
+	* new input for now (e.g. because it is rate limited):
+	* - POLLIN is neither set nor checked.
+	* - POLLOUT is set and checked, IOSocket::pollWrite will be called if
+	* data can be written.
+	* - POLLERR is set and checked, IOSocket::pollError will be called if an
+	* error occured.
+	*/
+	IOSOCKSTAT_SENDING,
 };
 
 /**
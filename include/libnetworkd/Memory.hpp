@@ -0,0 +1,137 @@
+/*
+ * Memory.hpp - pooled allocation for sockets and per-connection state
+ * $Id$
+ *
+ * This code is distributed governed by the terms listed in the LICENSE file in
+ * the top directory of this source package.
+ *
+ * (c) 2009 by Georg 'oxff' Wicherski, <gw@mwcollect.org>
+ *
+ */
+
+
+#ifndef __INCLUDE_libnetworkd_Memory_hpp
+#define __INCLUDE_libnetworkd_Memory_hpp
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+namespace libnetworkd
+{
+
+
+//! Alignment guaranteed for all memory handed out by MemoryPool / MemoryArena.
+#define MEMORY_ALIGNMENT 16
+
+
+/**
+ * Allocator for objects of one fixed size. Objects are carved from larger
+ * slabs and recycled through a free list, so connection churn does not hit
+ * malloc once the pool has grown to the working set. Slabs are only returned
+ * to the system when the pool itself is destroyed.
+ *
+ * Like everything else in libnetworkd, this class is not thread safe.
+ */
+class MemoryPool
+{
+public:
+	/**
+	 * Create a new, empty pool.
+	 * @param[in]	objectSize	Size of the objects handed out by allocate.
+	 * @param[in]	objectsPerSlab	Number of objects allocated at once when
+	 *	the pool runs empty.
+	 */
+	MemoryPool(size_t objectSize, uint32_t objectsPerSlab = 64);
+	~MemoryPool();
+
+	/**
+	 * Obtain an uninitialized object from the pool.
+	 * @return	Pointer to getObjectSize() bytes or NULL if out of memory.
+	 */
+	void * allocate();
+
+	/**
+	 * Return an object previously obtained from allocate.
+	 * @param[in]	object	The object, NULL is silently ignored.
+	 */
+	void release(void * object);
+
+	inline size_t getObjectSize()
+	{ return m_objectSize; }
+
+private:
+	bool grow();
+
+	struct FreeObject
+	{
+		FreeObject * next;
+	};
+
+	struct Slab
+	{
+		Slab * next;
+	};
+
+	size_t m_objectSize;
+	uint32_t m_objectsPerSlab;
+
+	FreeObject * m_freeList;
+	Slab * m_slabs;
+};
+
+
+/**
+ * Bump allocator for state that lives exactly as long as one connection.
+ * Every TcpSocket carries an arena, available through NetworkSocket::getArena,
+ * which is released in bulk when the socket is destroyed. The backing blocks
+ * are recycled between arenas of all connections.
+ *
+ * A NetworkEndpointFactory can construct its endpoints in the arena of the
+ * client socket passed to createEndpoint:
+ * \code
+ * void * memory = clientSocket->getArena()->allocate(sizeof(MyEndpoint));
+ * return new(memory) MyEndpoint(clientSocket);
+ * \endcode
+ * In this case, destroyEndpoint must be overridden to only call the
+ * endpoint's destructor, the memory goes away together with the socket.
+ */
+class MemoryArena
+{
+public:
+	MemoryArena();
+	~MemoryArena();
+
+	/**
+	 * Allocate uninitialized memory from this arena.
+	 * @param[in]	size	Number of bytes requested.
+	 * @return	Pointer to MEMORY_ALIGNMENT aligned memory or NULL if out of
+	 *	memory.
+	 */
+	void * allocate(size_t size);
+
+	/**
+	 * Release all memory obtained from this arena at once. No destructors
+	 * are called. The arena can be used again afterwards.
+	 */
+	void release();
+
+private:
+	struct Block
+	{
+		Block * next;
+	};
+
+	//! Blocks of the default size, recycled through a shared pool.
+	Block * m_blocks;
+	//! Oversized allocations, directly obtained from malloc.
+	Block * m_largeBlocks;
+
+	char * m_current;
+	size_t m_remaining;
+};
+
+
+}
+
+#endif // __INCLUDE_libnetworkd_Memory_hpp
@@ -15,15 +15,21 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 
+#include <deque>
 #include <map>
 #include <list>
 #include <string>
 using namespace std;
 
+#include "AddressTable.hpp"
 #include "IO.hpp"
+#include "Memory.hpp"
 #include "NameResolution.hpp"
+#include "RateLimit.hpp"
+#include "TimeoutManager.hpp"
 
 
 namespace libnetworkd
@@ -43,9 +49,9 @@ struct NetworkNode
 		return ((name == "any" || b.name == "any" || name == b.name) && port == b.port);
 	}
 	
-	bool operator()(const NetworkNode& a, const NetworkNode& b)
+	bool operator()(const NetworkNode& a, const NetworkNode& b) const
 	{
-		return (a.name != "any" && b.name != "any" && a.name < b.name) && a.port < b.port;
+		return a.name < b.name || (a.name == b.name && a.port < b.port);
 	}
 };
 
@@ -77,6 +83,19 @@ public:
 	 */
 	virtual void dataSent(uint32_t length) { }
 	
+	/**
+	 * File descriptors were passed over a UNIX domain socket (SCM_RIGHTS),
+	 * they arrived together with the given data. The endpoint takes over
+	 * the descriptors, e.g. with NetworkManager::adoptStream. The default
+	 * implementation closes them and passes the data on to dataRead.
+	 * @param[in]	descriptors	The received descriptors.
+	 * @param[in]	count	Number of descriptors.
+	 * @param[in]	buffer	The data received along with them.
+	 * @param[in]	dataLength	The length of the data in bytes.
+	 */
+	virtual void descriptorsReceived(const int * descriptors, uint32_t count,
+		const char * buffer, uint32_t dataLength);
+	
 	virtual void connectionEstablished(NetworkNode * remoteNode, NetworkNode * localNode) { }
 	virtual void connectionClosed() { }
 	virtual void connectionLost() { connectionClosed(); }
@@ -104,10 +123,39 @@ enum NetworkSocketState
 	//! output, then closes.
 	NETSOCKSTATE_GOING_DOWN,
 	
+	//! All output was sent and our side of the connection shut down, the
+	//! socket discards further input until the peer closes as well or the
+	//! linger timeout passes. The endpoint has already been released.
+	NETSOCKSTATE_LINGERING,
+	
 	//! The socket was closed.
 	NETSOCKSTATE_DOWN,
 };
 
+/**
+ * Traffic accounting of a single connection. All counters are plain integers
+ * updated in place on each event, all times are milliseconds as returned by
+ * ioTimeMillis.
+ */
+struct NetworkSocketStatistics
+{
+	uint64_t bytesRead;
+	uint64_t bytesSent;
+	
+	//! Number of accept, recv and send system calls issued.
+	uint32_t systemCalls;
+	
+	//! Largest size the userland output buffer has reached so far.
+	uint32_t peakOutputBuffer;
+	
+	//! Time spent in each NetworkSocketState, excluding the current one.
+	uint64_t stateTime[NETSOCKSTATE_DOWN + 1];
+	
+	uint64_t created;
+	uint64_t stateChanged;
+	uint64_t lastActivity;
+};
+
 class NetworkSocket
 {
 public:
@@ -116,6 +164,13 @@ public:
 	virtual void send(const char * buffer, uint32_t length) = 0;
 	virtual bool close(bool force = false) = 0;
 	virtual NetworkSocketState getState() = 0;
+	
+	/**
+	 * Per-connection arena, released in bulk once the socket is destroyed.
+	 * The default implementation provides no arena.
+	 * @return	The arena of this socket or NULL if not supported.
+	 */
+	virtual MemoryArena * getArena() { return 0; }
 };
 
 
@@ -130,10 +185,89 @@ public:
 
 
 class UdpSocket;
+class TcpSocket;
+class UnixSocket;
+class SharedRingSocket;
+
+
+//! Criterion to rank connections by in ConnectionTable::topConsumers.
+enum ConnectionTableKey
+{
+	CONNKEY_BYTES_READ,
+	CONNKEY_BYTES_SENT,
+	CONNKEY_BYTES_TOTAL,
+	CONNKEY_SYSTEM_CALLS,
+	CONNKEY_OUTPUT_BUFFER,
+	CONNKEY_PEAK_OUTPUT_BUFFER,
+	CONNKEY_IDLE_TIME,
+};
+
+/**
+ * Enumerable set of all TcpSocket's created through one NetworkManager,
+ * including listening sockets and connections still going up. Sockets link
+ * themselves in on creation and out on destruction; the list is intrusive,
+ * so neither costs an allocation.
+ */
+class ConnectionTable
+{
+public:
+	ConnectionTable();
+	
+	void insert(TcpSocket * socket);
+	void remove(TcpSocket * socket);
+	
+	//! Start of the enumeration, continue with TcpSocket::getNextConnection.
+	inline TcpSocket * getFirst()
+	{ return m_first; }
+	
+	inline uint32_t getSize()
+	{ return m_size; }
+	
+	/**
+	 * Find the connections with the highest value of the given statistic.
+	 * This is a single pass over the table and does not allocate.
+	 * @param[in]	key	Statistic to rank the connections by.
+	 * @param[out]	result	Receives the top connections, highest first.
+	 * @param[in]	count	Capacity of result.
+	 * @return	Number of connections stored in result.
+	 */
+	uint32_t topConsumers(ConnectionTableKey key, TcpSocket ** result, uint32_t count);
+	
+private:
+	TcpSocket * m_first;
+	uint32_t m_size;
+};
+
+
+/**
+ * Receiver of the outcome of a hot restart initiated by a new process of the
+ * same daemon, see NetworkManager::serveHandoff.
+ */
+class HandoffHandler
+{
+public:
+	virtual ~HandoffHandler() { }
+	
+	/**
+	 * The new process accepts on all our listeners now, they are closed
+	 * here already. Established connections are not affected, the process
+	 * should drain them and exit.
+	 */
+	virtual void handoffCompleted() = 0;
+	
+	//! A new process received the listeners but went away without taking
+	//! them over, we keep accepting.
+	virtual void handoffAborted() { }
+};
+
+
+//! Default bytes buffered in each direction of a SharedRingSocket.
+#define SHARED_RING_CAPACITY (1 << 20)
 
 class NetworkManager : public IOManager
 {
 public:	
+	NetworkManager();
 	virtual ~NetworkManager();
 	
 	virtual NetworkSocket * connectStream(const NetworkNode * remoteNode, NetworkEndpoint * localEndpoint,
@@ -141,23 +275,184 @@ public:
 	virtual NetworkSocket * serverStream(const NetworkNode * localNode, NetworkEndpointFactory * endpointFactory, uint8_t serverBacklogSize);
 	virtual bool closeStream(NetworkSocket * socket, bool force = false);
 	
-	virtual NetworkSocket * connectUnix(const char * path, NetworkEndpoint * localEndpoint);
-	virtual NetworkSocket * serverUnix(const char * path, NetworkEndpointFactory * endpointFactory, uint8_t serverBacklogSize);
+	/**
+	 * Take over an already connected TCP or UNIX domain stream or message
+	 * socket, e.g. one received from another process with
+	 * descriptorsReceived, and register it like a socket of connectStream.
+	 * @param[in]	connectedSocket	The socket, owned by the manager on success.
+	 * @param[in]	localEndpoint	Endpoint handling the connection, it
+	 *	receives connectionEstablished right away.
+	 * @return	The new socket or NULL if the descriptor is not a connected
+	 *	socket of a supported family and type.
+	 */
+	virtual NetworkSocket * adoptStream(int connectedSocket, NetworkEndpoint * localEndpoint);
+	
+	/**
+	 * Connect to or listen on a UNIX domain socket, see UnixSocket.
+	 * @param[in]	type	SOCK_STREAM or SOCK_SEQPACKET for message sockets.
+	 */
+	virtual NetworkSocket * connectUnix(const char * path, NetworkEndpoint * localEndpoint, int type = SOCK_STREAM);
+	virtual NetworkSocket * serverUnix(const char * path, NetworkEndpointFactory * endpointFactory, uint8_t serverBacklogSize,
+		int type = SOCK_STREAM);
 //	virtual bool closeUnix(NetworkSocket * unix, bool force = false);
 	
 	virtual NetworkSocket * connectDatagram(const NetworkNode * remoteNode, NetworkEndpoint * localEndpoint, const NetworkNode * localNode = 0);
 	virtual NetworkSocket * serverDatagram(const NetworkNode * localNode, NetworkEndpointFactory * endpointFactory);
 	virtual bool closeDatagram(NetworkSocket * socket, bool force = false);
 	
-	void dropDatagramSocket(NetworkNode& node, UdpSocket * socket);
+	//! Forget about a bound UdpSocket, called by the socket once closed.
+	void dropDatagramSocket(const struct sockaddr_in * localAddress, UdpSocket * socket);
+	
+	inline ConnectionTable * getConnectionTable()
+	{ return &m_connectionTable; }
+	
+	/**
+	 * Provide the timers used to resume rate limited sockets. Rate limits
+	 * are only enforced on sockets of a manager with a TimeoutManager.
+	 */
+	inline void setTimeoutManager(TimeoutManager * timeoutManager)
+	{ m_timeoutManager = timeoutManager; }
+	
+	inline TimeoutManager * getTimeoutManager()
+	{ return m_timeoutManager; }
+	
+	/**
+	 * Maximum time a gracefully closed TCP connection waits for the peer to
+	 * close its side as well, see TcpSocket::close. Defaults to 5 seconds.
+	 * @param[in]	seconds	Linger timeout, 0 closes connections right away.
+	 */
+	inline void setLingerTimeout(unsigned int seconds)
+	{ m_lingerTimeout = seconds; }
+	
+	inline unsigned int getLingerTimeout()
+	{ return m_lingerTimeout; }
+	
+	/**
+	 * Limit the aggregate rate of all TCP connections with a peer in the
+	 * same /24 network, applied to connections established afterwards.
+	 * @param[in]	readRate	Bytes per second read, 0 for unlimited.
+	 * @param[in]	writeRate	Bytes per second sent, 0 for unlimited.
+	 */
+	void setSubnetLimit(uint32_t readRate, uint32_t writeRate);
+	
+	//! Obtain a reference to the shared limit of the address' /24.
+	TrafficLimit * acquireSubnetLimit(const struct sockaddr_in * address);
+	void releaseSubnetLimit(const struct sockaddr_in * address);
+	
+	/**
+	 * Shard datagram servers across several reactors, each running its own
+	 * NetworkManager in its own thread. serverDatagram then binds with
+	 * SO_REUSEPORT, every manager gets a socket of its own on the same port
+	 * and the kernel distributes datagrams among them by flow hash, so the
+	 * endpoints of a peer always live in the same reactor.
+	 * @param[in]	shards	Number of managers sharing their datagram ports,
+	 *	0 disables sharding.
+	 * @param[in]	cpu	CPU the thread of this manager is pinned to or -1.
+	 *	If given, datagrams are steered to the shard running on the CPU
+	 *	which received them instead, which requires shard i to be pinned
+	 *	to CPU i and to bind its sockets in that order.
+	 */
+	inline void setDatagramSharding(uint32_t shards, int cpu = -1)
+	{ m_datagramShards = shards; m_datagramCpu = cpu; }
+	
+	/**
+	 * Offer our listening sockets of serverStream and serverUnix to the next
+	 * generation of this process for a restart without downtime. A new
+	 * process connecting to the given UNIX domain socket receives all of
+	 * them, and once it accepts on them, ours are closed and the handler
+	 * is notified. Both processes share the very same kernel sockets during
+	 * the transition, so no pending or incoming connection is lost.
+	 * @param[in]	path	Well-known path of the handoff socket, a stale
+	 *	socket of a previous generation is replaced.
+	 * @param[in]	handler	Notified once the new process took over.
+	 * @return	False if the socket could not be bound.
+	 */
+	bool serveHandoff(const char * path, HandoffHandler * handler);
+	
+	/**
+	 * Obtain the listening sockets of a running old process serving a
+	 * handoff at the given path. This blocks for at most a few seconds.
+	 * serverStream and serverUnix then use the received socket for the
+	 * same address instead of binding a new one.
+	 * @return	Number of listeners received, 0 if there is no old process.
+	 */
+	uint32_t inheritListeners(const char * path);
+	
+	/**
+	 * Tell the old process that we accept on the inherited listeners, so it
+	 * stops accepting and drains. Inherited listeners not claimed by
+	 * serverStream or serverUnix until now are closed.
+	 * @return	False if no handoff was in progress or the old process is
+	 *	gone already.
+	 */
+	bool completeHandoff();
+	
+	//! Send all our listeners over the given connection, used by the
+	//! handoff socket once a new process connected.
+	void handOffListeners(UnixSocket * socket);
+	
+	//! Close our listeners after the new process took over.
+	void finishHandoff(bool completed);
+	
+	/**
+	 * Connect to a serverSharedRing of a local process. The connection is
+	 * negotiated over the UNIX domain socket at the given path and then
+	 * carries its data through shared memory, see SharedRingSocket.
+	 * @param[in]	path	Path of the UNIX domain socket of the server.
+	 * @param[in]	localEndpoint	Endpoint receiving connectionEstablished
+	 *	once the server mapped the ring.
+	 * @param[in]	capacity	Bytes buffered in each direction, rounded up
+	 *	to a power of two.
+	 * @return	The new socket or NULL if the ring could not be created or
+	 *	the server not be reached.
+	 */
+	NetworkSocket * connectSharedRing(const char * path, NetworkEndpoint * localEndpoint,
+		uint32_t capacity = SHARED_RING_CAPACITY);
+	
+	/**
+	 * Accept shared memory connections of connectSharedRing on a UNIX
+	 * domain socket. Endpoints are created by the given factory.
+	 */
+	NetworkSocket * serverSharedRing(const char * path, NetworkEndpointFactory * endpointFactory,
+		uint8_t serverBacklogSize);
 
 protected:
-	map<NetworkNode, UdpSocket *, NetworkNode> m_boundDatagramSockets;
+	ConnectionTable m_connectionTable;
+	TimeoutManager * m_timeoutManager;
+	unsigned int m_lingerTimeout;
+	
+	uint32_t m_subnetReadRate;
+	uint32_t m_subnetWriteRate;
+	
+	//! Shared limits by /24 in network byte order, dropped when unused.
+	map<uint32_t, TrafficLimit *> m_subnetLimits;
+	
+	//! Find or create the UdpSocket bound to the given local node.
+	UdpSocket * bindDatagram(const NetworkNode * localNode, bool server = false);
+	
+	AddressTable<UdpSocket *> m_boundDatagramSockets;
+	
+	uint32_t m_datagramShards;
+	int m_datagramCpu;
+	
+	//! Claim the inherited listener bound to the given address, -1 if none.
+	int takeInheritedListener(const struct sockaddr * address);
+	
+	NetworkSocket * m_handoffServer;
+	NetworkEndpointFactory * m_handoffFactory;
+	HandoffHandler * m_handoffHandler;
+	
+	//! Connection to the old process while taking over its listeners.
+	int m_handoffSocket;
+	map<string, int> m_inheritedListeners;
+	
+	//! Negotiating factories of serverSharedRing, one per listener.
+	list<NetworkEndpointFactory *> m_sharedRingFactories;
 };
 
 
 //! Implementation of IOSocket for TCP based POSIX network sockets.
-class TcpSocket : public NetworkSocket, public IOSocket
+class TcpSocket : public NetworkSocket, public IOSocket, public TimeoutReceiver
 {
 public:
 	TcpSocket();
@@ -172,16 +467,171 @@ public:
 	virtual bool connect(struct sockaddr_in * remoteHost);
 	virtual bool bind(struct sockaddr_in * localAddress);
 	virtual bool listen(uint8_t backlogSize);	
+	
+	/**
+	 * Use an already connected socket instead of connecting, the endpoint
+	 * receives connectionEstablished right away.
+	 * @return	False if the descriptor is invalid, it is not closed then.
+	 */
+	bool adopt(int connectedSocket);
+	
+	//! Accept on an already listening socket instead of binding a new one.
+	bool adoptListener(int listeningSocket);
+	
+	inline int getDescriptor()
+	{ return m_socket; }
+	
+	/**
+	 * Close the connection. Unless forced, remaining output is flushed first
+	 * and the connection is then shut down gracefully: our side is shut down
+	 * with shutdown(SHUT_WR) and further input is discarded until the peer
+	 * closes as well, so unread data does not make the kernel reset the
+	 * connection. This lingering is bounded by the linger timeout of the
+	 * NetworkManager and needs its TimeoutManager, sockets without either
+	 * are closed right after flushing.
+	 * The endpoint receives connectionClosed once the output is flushed.
+	 * @param[in]	force	Drop remaining output and close right away.
+	 * @return	False if output still needs to be flushed, the endpoint is
+	 *	notified later then.
+	 */
 	virtual bool close(bool force = false);
 	
 	virtual void send(const char * buffer, uint32_t length);
 	
 	virtual NetworkSocketState getState();
 	
+	virtual MemoryArena * getArena()
+	{ return &m_arena; }
+	
+	/**
+	 * Associate this socket with the manager that created it, which links it
+	 * into the manager's ConnectionTable. Connections accepted by a listening
+	 * socket inherit its manager.
+	 */
+	void setNetworkManager(NetworkManager * networkManager);
+	
+	inline const NetworkSocketStatistics * getStatistics()
+	{ return &m_statistics; }
+	
+	//! Current size of the userland output buffer in bytes.
+	inline uint32_t getOutputBufferSize()
+	{ return m_outputBuffer.size(); }
+	
+	inline bool isServer()
+	{ return m_serverSocket; }
+	
+	//! Address of the peer, all zero for listening and UNIX domain sockets.
+	inline const struct sockaddr_in * getRemoteAddress()
+	{ return &m_remoteAddress; }
+	
+	inline TcpSocket * getNextConnection()
+	{ return m_nextConnection; }
+	
+	/**
+	 * Limit the rate at which data is read from this socket. While the
+	 * socket is out of tokens, it is not polled for input at all. On a
+	 * listening socket, the limit is shared by all connections accepted
+	 * afterwards instead.
+	 * Tokens are refilled continuously, but throttled sockets are only
+	 * resumed at the one second granularity of the TimeoutManager, so the
+	 * burst is raised to at least one second worth of data.
+	 * @param[in]	rate	Bytes per second, 0 removes the limit.
+	 * @param[in]	burst	Bytes that may be read at once after idling.
+	 * @return	False if the socket has no NetworkManager with a
+	 *	TimeoutManager to enforce the limit.
+	 */
+	bool setReadLimit(uint32_t rate, uint32_t burst = 0);
+	
+	//! Limit the rate at which data is sent, see setReadLimit.
+	bool setWriteLimit(uint32_t rate, uint32_t burst = 0);
+	
+	virtual void timeoutFired(Timeout timeout);
+	
+	//! TcpSocket and derived classes are recycled through MemoryPool's.
+	static void * operator new(size_t size);
+	static void operator delete(void * object, size_t size);
+	
 protected:
 	bool socket();
 	
-	TcpSocket(IOManager * ioManager, int connectedSocket, NetworkEndpointFactory * factory, struct sockaddr_in * remoteAddress);
+	TcpSocket(IOManager * ioManager, int connectedSocket, NetworkEndpointFactory * factory, struct sockaddr_in * remoteAddress,
+		TcpSocket * listener);
+	
+	//! Transfer data on the connected socket, like recv and send.
+	virtual int receive(char * buffer, uint32_t length);
+	virtual int transmit(const char * buffer, uint32_t length);
+	
+	//! Hand data just received to the endpoint.
+	virtual void deliver(const char * buffer, uint32_t length);
+	
+	//! Take over the NetworkManager and shared limits of our listener.
+	void inheritListener(TcpSocket * listener);
+	void attachSubnetLimit();
+	void releaseLimits();
+	
+	//! Number of bytes out of wanted the rate limits allow to transfer now.
+	uint32_t allowance(bool write, uint32_t wanted);
+	void consume(bool write, uint32_t length);
+	
+	//! Start lingering, the endpoint is released.
+	bool linger();
+	void finishLinger();
+	
+	//! Stop polling for the given THROTTLE_* direction until tokens refill.
+	void throttle(uint8_t direction);
+	
+	//! Derive the IOSocketState from output buffer and throttling.
+	inline void updateInterest()
+	{
+		bool write = !m_outputBuffer.empty() && !(m_throttled & THROTTLE_WRITE);
+		
+		if(!(m_throttled & THROTTLE_READ))
+			m_ioSocketState = write ? IOSOCKSTAT_BUFFERING : IOSOCKSTAT_IDLE;
+		else
+			m_ioSocketState = write ? IOSOCKSTAT_SENDING : IOSOCKSTAT_BUSY;
+	}
+	
+	//! Switch to a new state, accounting the time spent in the old one.
+	inline void setState(NetworkSocketState state)
+	{
+		uint64_t now = ioTimeMillis();
+		
+		m_statistics.stateTime[m_state] += now - m_statistics.stateChanged;
+		m_statistics.stateChanged = now;
+		
+		m_state = state;
+	}
+	
+	void resetStatistics();
+	
+	//! Account a send / recv of the given result, called after each syscall.
+	inline void countSent(int sent)
+	{
+		++m_statistics.systemCalls;
+		
+		if(sent > 0)
+		{
+			m_statistics.bytesSent += sent;
+			m_statistics.lastActivity = ioTimeMillis();
+		}
+	}
+	
+	inline void countRead(int read)
+	{
+		++m_statistics.systemCalls;
+		
+		if(read > 0)
+		{
+			m_statistics.bytesRead += read;
+			m_statistics.lastActivity = ioTimeMillis();
+		}
+	}
+	
+	inline void countBuffered()
+	{
+		if(m_outputBuffer.size() > m_statistics.peakOutputBuffer)
+			m_statistics.peakOutputBuffer = m_outputBuffer.size();
+	}
 	
 
 protected:	
@@ -195,51 +645,309 @@ protected:
 
 	NetworkSocketState m_state;
 	bool m_serverSocket;
+	
+	MemoryArena m_arena;
+	
+	NetworkSocketStatistics m_statistics;
+	struct sockaddr_in m_remoteAddress;
+	
+	NetworkManager * m_networkManager;
+	
+	enum
+	{
+		THROTTLE_READ = 1,
+		THROTTLE_WRITE = 2,
+	};
+	
+	TrafficLimit m_trafficLimit;
+	//! Aggregate limits shared with other connections, NULL if none.
+	TrafficLimit * m_listenerLimit;
+	TrafficLimit * m_subnetLimit;
+	
+	uint8_t m_throttled;
+	Timeout m_throttleTimeout;
+	
+	Timeout m_lingerTimeout;
+	
+private:
+	friend class ConnectionTable;
+	
+	TcpSocket * m_nextConnection;
+	TcpSocket * m_previousConnection;
 };
 
 
+//! Maximum number of descriptors passed along with one send.
+#define UNIX_MAX_DESCRIPTORS 16
+//! Maximum size of a message on a SOCK_SEQPACKET socket.
+#define UNIX_MAX_MESSAGE 65536
+
+/**
+ * Stream or, with SOCK_SEQPACKET, message socket in the UNIX domain. On a
+ * message socket, every send is one message and every dataRead is exactly
+ * one message of the peer; empty messages are not sent. A path starting with
+ * '@' names an address in the abstract namespace, which has no file.
+ */
 class UnixSocket : public TcpSocket
 {
 public:
-	UnixSocket(IOManager * ioManager, NetworkEndpoint * clientEndpoint);
+	UnixSocket(IOManager * ioManager, NetworkEndpoint * clientEndpoint, int type = SOCK_STREAM);
 	UnixSocket(IOManager * ioManager,
-		NetworkEndpointFactory * serverEndpointFactory);
-	virtual ~UnixSocket() { }
+		NetworkEndpointFactory * serverEndpointFactory, int type = SOCK_STREAM);
+	virtual ~UnixSocket();
 	
 	virtual void pollRead();
 
 	virtual bool connect(const char * serverPath);
 	virtual bool bind(const char * serverPath);
+	
+	virtual void send(const char * buffer, uint32_t length);
+	
+	/**
+	 * Fill in the address for a path, '@' selecting the abstract namespace.
+	 * @param[out]	address	Receives the address, unused bytes zeroed.
+	 * @param[in]	path	File system path or '@' and abstract name.
+	 * @return	The length of the address to pass to bind or connect.
+	 */
+	static socklen_t makeAddress(struct sockaddr_un * address, const char * path);
+	
+	/**
+	 * Pass file descriptors to the peer (SCM_RIGHTS). They are delivered to
+	 * its endpoint with descriptorsReceived, in order with all data sent
+	 * before, together with the read containing the first bytes of the given
+	 * data. That read might also contain data sent before, but never data
+	 * sent afterwards. The caller keeps its descriptors, duplicates are sent.
+	 * @param[in]	descriptors	The descriptors to pass.
+	 * @param[in]	count	Number of descriptors, at most UNIX_MAX_DESCRIPTORS.
+	 * @param[in]	buffer	Data to send along, at least one byte.
+	 * @param[in]	length	Length of the data.
+	 * @return	False if the socket is not connected or the descriptors could
+	 *	not be duplicated.
+	 */
+	bool sendDescriptors(const int * descriptors, uint32_t count,
+		const char * buffer, uint32_t length);
 
 protected:
 	bool socket();
 	
-	UnixSocket(IOManager * ioManager, int connectedSocket, NetworkEndpointFactory * factory);
+	UnixSocket(IOManager * ioManager, int connectedSocket, NetworkEndpointFactory * factory,
+		TcpSocket * listener);
+	
+	virtual int receive(char * buffer, uint32_t length);
+	virtual int transmit(const char * buffer, uint32_t length);
+	virtual void deliver(const char * buffer, uint32_t length);
+	
+private:
+	void initialize(int type);
+	
+	//! SOCK_STREAM or SOCK_SEQPACKET.
+	int m_type;
+	
+	//! Lengths of the messages in the output buffer, SOCK_SEQPACKET only.
+	deque<uint32_t> m_messageLengths;
+	//! The message last received, SOCK_SEQPACKET only.
+	char * m_message;
+	
+	//! Descriptors waiting for the output stream to reach their data.
+	struct PendingDescriptors
+	{
+		uint64_t position;
+		uint32_t length;
+		uint32_t count;
+		int descriptors[UNIX_MAX_DESCRIPTORS];
+	};
+	
+	list<PendingDescriptors> m_pendingDescriptors;
+	//! Bytes of the output stream passed to the kernel so far.
+	uint64_t m_transmitted;
+	
+	//! Descriptors of the last receive, delivered along with its data.
+	int m_receivedDescriptors[UNIX_MAX_DESCRIPTORS];
+	uint32_t m_receivedCount;
+};
+
+
+/**
+ * Indices of one direction of a SharedRingSocket, placed in the shared
+ * memory in front of the data. Each side writes its own cache line only,
+ * except for the flags asking the other side to ring its doorbell.
+ */
+struct SharedRingHeader
+{
+	//! Bytes ever produced, written by the producer.
+	volatile uint32_t head;
+	//! Set by the producer once it will not produce anymore.
+	volatile uint32_t closed;
+	//! Set by the producer while it waits for room.
+	volatile uint32_t full;
+	char producerPadding[64 - 3 * sizeof(uint32_t)];
+	
+	//! Bytes ever consumed, written by the consumer.
+	volatile uint32_t tail;
+	//! Set by the consumer before it goes back to poll.
+	volatile uint32_t waiting;
+	char consumerPadding[64 - 2 * sizeof(uint32_t)];
+};
+
+class SharedRingControl;
+
+/**
+ * Stream connection to another local process through a pair of
+ * single-producer single-consumer rings in shared memory (memfd), one per
+ * direction. Data is copied into the ring by send and handed to dataRead
+ * straight from the shared memory, the kernel sees neither. Each side polls
+ * an eventfd as its doorbell, which the other side only rings if the
+ * consumer sleeps or the producer waits for room, so a busy connection
+ * does not cost any system call per send.
+ *
+ * The rings and doorbells are passed over a UNIX domain socket, which stays
+ * open for the lifetime of the connection to notice the peer's death. See
+ * NetworkManager::connectSharedRing and NetworkManager::serverSharedRing.
+ */
+class SharedRingSocket : public NetworkSocket, public IOSocket
+{
+public:
+	SharedRingSocket(NetworkManager * networkManager, NetworkEndpoint * clientEndpoint);
+	SharedRingSocket(NetworkManager * networkManager, NetworkEndpointFactory * serverEndpointFactory);
+	virtual ~SharedRingSocket();
+	
+	virtual void pollRead();
+	virtual void pollWrite();
+	virtual void pollError();
+	
+	virtual void send(const char * buffer, uint32_t length);
+	virtual bool close(bool force = false);
+	virtual NetworkSocketState getState();
+	
+protected:
+	friend class NetworkManager;
+	friend class SharedRingControl;
+	
+	/**
+	 * Create the shared memory and doorbells as the connecting side.
+	 * @param[out]	descriptors	Receives the memory, our doorbell and the
+	 *	peer's doorbell, in the order they are passed to the peer.
+	 */
+	bool create(uint32_t capacity, int * descriptors);
+	//! Map the memory received from the connecting side, see create.
+	bool attach(const int * descriptors);
+	
+	//! The peer mapped the ring, start delivering data.
+	void establish();
+	//! The negotiating UNIX domain socket went away with the peer.
+	void controlLost();
+	
+	void setControl(UnixSocket * control, SharedRingControl * endpoint);
+	
+private:
+	void initialize();
+	bool mapMemory(int memory, uint32_t capacity, bool connecting);
+	
+	//! Copy as much as fits into the ring, return the bytes copied.
+	uint32_t produce(const char * buffer, uint32_t length);
+	
+	//! Move buffered output into the ring, false if that closed us.
+	bool flush();
+	//! Deliver everything in the ring, false if we were destroyed.
+	bool drain();
+	
+	void ring();
+	void destroy(bool lost);
+	
+	NetworkManager * m_networkManager;
+	NetworkEndpoint * m_clientEndpoint;
+	NetworkEndpointFactory * m_serverEndpointFactory;
+	NetworkSocketState m_state;
+	
+	UnixSocket * m_control;
+	SharedRingControl * m_controlEndpoint;
+	
+	char * m_memory;
+	size_t m_size;
+	uint32_t m_capacity;
+	
+	SharedRingHeader * m_transmit;
+	SharedRingHeader * m_receive;
+	char * m_transmitData;
+	char * m_receiveData;
+	
+	int m_doorbell;
+	int m_peerDoorbell;
+	
+	//! Data that did not fit into the ring yet.
+	string m_outputBuffer;
+	
+	//! Set by destroy, so callers of the endpoint notice it closed us.
+	bool * m_destroyed;
 };
 
 
 class UdpSocket;
 
+//! Number of datagrams received or sent with one system call.
+#define UDP_BATCH_SIZE 32
+
+//! Default number and payload size of the slots queueing outgoing datagrams.
+#define UDP_QUEUE_SLOTS 64
+#define UDP_QUEUE_SLOT_SIZE 2048
+
+//! What to do with an outgoing datagram if the queue of a UdpSocket is full.
+enum UdpDropPolicy
+{
+	//! Drop the new datagram.
+	UDP_DROP_TAIL,
+	//! Drop the oldest queued datagram to make room for the new one.
+	UDP_DROP_OLDEST
+};
+
 //! Wrapper around a UdpSocket featuring the classical send() as it locally
 //! stores the destination network node for all packets.
 class UdpSocketWrapper : public NetworkSocket
 {
 public:
-	UdpSocketWrapper(UdpSocket * parent, const NetworkNode& node)
-	{ m_parent = parent; m_node = node; }
+	UdpSocketWrapper(UdpSocket * parent, const NetworkNode& node, const struct sockaddr_in& address)
+	{ m_parent = parent; m_node = node; m_address = address; }
 	virtual ~UdpSocketWrapper();
 	
 	virtual void send(const char * buffer, uint32_t length);
 	virtual bool close(bool force = false);
 	virtual NetworkSocketState getState();
 	
+	inline const struct sockaddr_in * getAddress()
+	{ return &m_address; }
+	
 private:
 	UdpSocket * m_parent;
 	NetworkNode m_node;
+	
+	//! Binary form of m_node, so sending does not need to parse it.
+	struct sockaddr_in m_address;
 };
 
-//! Implementation of IOSocket for UDP based POSIX network sockets.
-class UdpSocket : public IOSocket
+//! Endpoint associated with one remote ip:port of a UdpSocket.
+struct UdpPeer
+{
+	UdpSocketWrapper * wrapper;
+	NetworkEndpoint * endpoint;
+	
+	//! Created by the endpoint factory of the socket, destroyed through it.
+	bool fromFactory;
+	
+	//! Factory peers ordered by their last received datagram, newest first.
+	UdpPeer * newer;
+	UdpPeer * older;
+	time_t lastActivity;
+};
+
+/**
+ * Implementation of IOSocket for UDP based POSIX network sockets. Datagrams
+ * are demultiplexed to one endpoint per remote ip:port, which are either
+ * added explicitly with addEndpoint or created by an endpoint factory for
+ * each new source. Reception and transmission are batched, one readiness
+ * event receives up to UDP_BATCH_SIZE datagrams with a single recvmmsg and
+ * replies queued meanwhile are flushed with a single sendmmsg afterwards.
+ */
+class UdpSocket : public NetworkSocket, public IOSocket, public TimeoutReceiver
 {
 public:
 	UdpSocket(IOManager * ioManager, NetworkEndpointFactory * endpointFactory = 0);
@@ -251,29 +959,215 @@ public:
 	
 	virtual bool bind(struct sockaddr_in localAddress);	
 	virtual void sendTo(const char * buffer, uint32_t length, const NetworkNode& target);
+	virtual void sendTo(const char * buffer, uint32_t length, const struct sockaddr_in * target);
+	
+	//! Datagrams need a destination, use sendTo or a UdpSocketWrapper.
+	virtual void send(const char * buffer, uint32_t length) { }
 	
+	/**
+	 * Close the socket, all endpoints receive connectionClosed. Unless
+	 * forced, queued datagrams are sent first.
+	 */
+	virtual bool close(bool force = false);
+	
+	/**
+	 * Associate an endpoint with a remote ip:port.
+	 * @param[in]	networkNode	The remote node, name must be an IPv4
+	 *	address in numbers-and-dots notation.
+	 * @param[in]	endpoint	Endpoint receiving the node's datagrams.
+	 * @return	Socket to send to the node or NULL if the node is invalid
+	 *	or already associated.
+	 */
 	virtual UdpSocketWrapper * addEndpoint(const NetworkNode& networkNode, NetworkEndpoint * endpoint);
 	virtual bool dropEndpoint(UdpSocketWrapper * wrapper, NetworkNode& remoteNode);
 	
-	inline NetworkSocketState getState()
+	virtual NetworkSocketState getState()
 	{ return m_state; }
 	
+	//! Register with the manager keeping track of this socket's binding.
+	inline void setNetworkManager(NetworkManager * networkManager)
+	{ m_networkManager = networkManager; }
+	
+	inline void setEndpointFactory(NetworkEndpointFactory * endpointFactory)
+	{ m_serverEndpointFactory = endpointFactory; }
+	
+	inline NetworkEndpointFactory * getEndpointFactory()
+	{ return m_serverEndpointFactory; }
+	
+	//! Address this socket is bound to, valid after bind.
+	inline const NetworkNode& getLocalNode()
+	{ return m_localNode; }
+	
+	inline const struct sockaddr_in * getLocalAddress()
+	{ return &m_localAddress; }
+	
+	/**
+	 * Use UDP generic segmentation offload for queued datagrams: a run of
+	 * equally sized datagrams to the same target is handed to the kernel as
+	 * a single message and only split into packets by the kernel or the
+	 * NIC. Only has an effect when sends are queued, i.e. for replies
+	 * sent from within dataRead or while the socket is buffering.
+	 * @return	False if the socket is not bound yet or the system does not
+	 *	support UDP_SEGMENT.
+	 */
+	bool setSendOffload(bool enable);
+	
+	/**
+	 * Let the kernel coalesce datagrams of one source into a single
+	 * receive (UDP_GRO). They are still delivered to the endpoint as
+	 * individual dataRead calls.
+	 * @return	False if the socket is not bound yet or the system does not
+	 *	support UDP_GRO.
+	 */
+	bool setReceiveOffload(bool enable);
+	
+	//! Allow other sockets to bind the same address and port, must be set
+	//! before bind.
+	inline void setReusePort(bool reusePort)
+	{ m_reusePort = reusePort; }
+	
+	/**
+	 * Tell the kernel which CPU processes this socket (SO_INCOMING_CPU), so
+	 * it prefers it for datagrams received on that CPU among sockets sharing
+	 * a port.
+	 */
+	bool setIncomingCpu(int cpu);
+	
+	/**
+	 * Attach a classic BPF program to the SO_REUSEPORT group of this socket
+	 * which selects the socket by the CPU receiving a datagram, the socket
+	 * bound as n-th member of the group gets datagrams of CPUs n, n + shards
+	 * and so on.
+	 * @param[in]	shards	Number of sockets in the group.
+	 * @return	False if not supported by the system.
+	 */
+	bool steerByCpu(uint32_t shards);
+	
+	/**
+	 * Expire endpoints created by the endpoint factory which did not receive
+	 * a datagram for the given time. They receive connectionLost. Requires
+	 * the socket to be managed by a NetworkManager with a TimeoutManager.
+	 * @param[in]	idleTimeout	Seconds of inactivity, 0 to disable expiry.
+	 * @return	False if no TimeoutManager is available.
+	 */
+	bool setIdleTimeout(unsigned int idleTimeout);
+	
+	/**
+	 * Limit the number of endpoints created by the endpoint factory. Once
+	 * the limit is reached, a new source evicts the least recently active
+	 * one, which receives connectionLost.
+	 * @param[in]	maxPeers	Upper bound of factory endpoints, 0 for no limit.
+	 */
+	inline void setMaxPeers(uint32_t maxPeers)
+	{ m_maxPeers = maxPeers; }
+	
+	//! Number of endpoints currently created by the endpoint factory.
+	inline uint32_t getFactoryPeers()
+	{ return m_factoryPeers; }
+	
+	//! Number of endpoints, added ones and those of the endpoint factory.
+	inline uint32_t getPeers()
+	{ return m_clientEndpoints.getSize(); }
+	
+	/**
+	 * Configure the queue of datagrams which could not be sent right away.
+	 * The queue is a ring of slots with inline payload, allocated once when
+	 * the first datagram is queued. Datagrams larger than a slot are never
+	 * queued, they are dropped if the kernel does not take them at once.
+	 * @param[in]	slots	Number of datagrams the queue holds.
+	 * @param[in]	slotSize	Maximum payload of a queued datagram.
+	 * @param[in]	policy	Which datagram to drop if the queue is full.
+	 * @return	False if datagrams are queued at the moment.
+	 */
+	bool setQueueLimits(uint32_t slots, uint32_t slotSize, UdpDropPolicy policy);
+	
+	//! Number of outgoing datagrams dropped because the queue was full.
+	inline uint64_t getDroppedDatagrams()
+	{ return m_droppedDatagrams; }
+	
+	virtual void timeoutFired(Timeout timeout);
+	
 protected:
 	bool socket();
 	
+	//! Dispatch a received datagram to the endpoint of its source.
+	void datagramRead(const struct sockaddr_in * source, const char * buffer, uint32_t length);
+	
+	//! Send as many queued datagrams as the kernel takes.
+	void flush();
+	void destroy();
+	
+	//! Forget about a peer, notify and destroy its endpoint.
+	void removePeer(UdpPeer * peer, bool lost);
+	
+	//! Schedule the expiry of the least recently active factory peer.
+	void scheduleExpiry(time_t now);
+	
 private:
-	struct PacketCache
+	struct QueueSlot
 	{
-		NetworkNode target;
-		string buffer;
+		struct sockaddr_in target;
+		uint32_t length;
 	};
 	
-	list<PacketCache> m_packetCache;
+	//! Slot at the given offset from the head, its payload follows it.
+	inline QueueSlot * queueSlot(uint32_t offset)
+	{
+		uint32_t index = m_queueHead + offset;
+		
+		if(index >= m_queueSlots)
+			index -= m_queueSlots;
+		
+		return (QueueSlot *) (m_queue + index * m_queueStride);
+	}
+	
+	//! Drop count datagrams from the head of the queue.
+	inline void dequeue(uint32_t count)
+	{
+		if((m_queueHead += count) >= m_queueSlots)
+			m_queueHead -= m_queueSlots;
+		
+		m_queueCount -= count;
+	}
+	
+	char * m_queue;
+	uint32_t m_queueSlots;
+	uint32_t m_queueSlotSize;
+	uint32_t m_queueStride;
+	uint32_t m_queueHead;
+	uint32_t m_queueCount;
+	UdpDropPolicy m_dropPolicy;
+	uint64_t m_droppedDatagrams;
 
 	IOManager * m_ioManager;
 	int m_socket;
 	
-	map<NetworkNode, pair<UdpSocketWrapper *, NetworkEndpoint *>, NetworkNode> m_clientEndpoints;
+	//! Endpoints by remote address, looked up for each datagram.
+	AddressTable<UdpPeer *> m_clientEndpoints;
+	MemoryPool m_peerPool;
+	
+	UdpPeer * m_newestPeer;
+	UdpPeer * m_oldestPeer;
+	uint32_t m_factoryPeers;
+	uint32_t m_maxPeers;
+	
+	TimeoutManager * m_timeoutManager;
+	unsigned int m_idleTimeout;
+	Timeout m_expiryTimeout;
+	
+	//! Time of the current pollRead, stamped on the peers it reaches.
+	time_t m_readTime;
+	
+	NetworkManager * m_networkManager;
+	NetworkNode m_localNode;
+	struct sockaddr_in m_localAddress;
+	
+	//! Within pollRead, sends are queued and flushed at once afterwards.
+	bool m_batching;
+	
+	bool m_sendOffload;
+	bool m_receiveOffload;
+	bool m_reusePort;
 	
 	/**
 	 * If desired, this endpoint factory creates new endpoints each time a 
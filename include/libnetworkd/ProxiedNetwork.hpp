@@ -16,6 +16,7 @@
 
 
 #include <list>
+#include <vector>
 #include <tr1/unordered_map>
 
 
@@ -27,27 +28,158 @@ namespace libnetworkd
 {
 
 
+//! Longest user/password authentication message.
+#define SOCKS5_AUTH_MAX (3 + 255 + 255)
+//! Longest CONNECT request, the one naming the target by domain.
+#define SOCKS5_REQUEST_MAX (4 + 1 + 255 + 2)
+//! Longest sequence of replies to a pipelined handshake.
+#define SOCKS5_REPLIES_MAX (2 + 2 + SOCKS5_REQUEST_MAX)
+
+//! Consecutive failed handshakes after which a proxy is ejected.
+#define PROXY_EJECT_FAILURES 3
+//! Seconds of the first ejection, doubled with every failed probe.
+#define PROXY_EJECT_TIME 10
+//! Upper bound of an ejection in seconds.
+#define PROXY_EJECT_MAX 300
+
+/**
+ * Handshake statistics of one proxy, shared by all sets containing it. A
+ * proxy failing PROXY_EJECT_FAILURES handshakes in a row is ejected; once
+ * its time is up, a probe connection decides whether it comes back.
+ */
+struct ProxyHealth
+{
+	ProxyHealth()
+	{
+		latency = 0;
+		pending = 0;
+		failures = 0;
+		ejections = 0;
+		ejectedUntil = 0;
+		probing = false;
+	}
+	
+	//! A handshake completed after the given milliseconds.
+	void succeeded(uint32_t millis);
+	//! A handshake failed at the given ioTimeMillis.
+	void failed(uint64_t now);
+	
+	inline bool isEjected()
+	{ return ejectedUntil != 0; }
+	
+	//! Expected cost of one more connection, lower is better.
+	inline uint64_t cost()
+	{ return (uint64_t) (latency + 1) * (pending + 1); }
+	
+	//! Smoothed handshake latency in milliseconds, 0 if never measured.
+	uint32_t latency;
+	//! Handshakes in progress.
+	uint32_t pending;
+	//! Failed handshakes since the last successful one.
+	uint32_t failures;
+	//! Ejections since the proxy last worked, for the backoff.
+	uint32_t ejections;
+	//! Not chosen for connections before this ioTimeMillis, 0 if healthy.
+	uint64_t ejectedUntil;
+	//! A probe of the ejected proxy is in progress.
+	bool probing;
+};
+
+//! Protocol spoken with a proxy.
+enum ProxyProtocol
+{
+	PROXY_SOCKS5,
+	PROXY_HTTP_CONNECT,
+};
 
 struct ProxyAddress	
 {
 	uint32_t host;
 	uint16_t port;
+	//! host and port, ready to connect to.
+	struct sockaddr_in address;
 	string		user;
 	string		password;
+	
+	ProxyProtocol protocol;
+	
+	//! Send greeting, authentication and CONNECT without waiting in between.
+	bool optimistic;
+	
+	ProxyHealth * health;
+	
+	//! Proxy this one is asked to connect to, NULL for the target itself.
+	struct ProxyAddress * nextHop;
 };
 
 
+//! How ProxiedNetworkManager::getNextProxy chooses among healthy proxies.
+enum ProxySelection
+{
+	//! Cycle through the proxies.
+	PROXY_ROUND_ROBIN,
+	//! Lowest latency, weighted by the handshakes in progress.
+	PROXY_LEAST_LATENCY,
+	//! The better one of two proxies chosen at random.
+	PROXY_TWO_CHOICES,
+	/**
+	 * The same proxy for the same target host, by rendezvous hashing. Adding
+	 * or ejecting a proxy only moves the hosts it gains or loses.
+	 */
+	PROXY_AFFINITY,
+};
+
+
+//! Seconds before a pool of warm proxy sessions that lost some is refilled.
+#define PROXY_WARM_RETRY 1
+
+
+
+class ProxiedTcpSocket;
 
 // proxy-enabled version of NetworkManager:
-class ProxiedNetworkManager : public NetworkManager
+class ProxiedNetworkManager : public NetworkManager, public TimeoutReceiver
 {
+	friend class ProxiedTcpSocket;
+	
 public:
-	ProxiedNetworkManager() { m_currentSet = 0; }
+	ProxiedNetworkManager();
 	virtual ~ProxiedNetworkManager();
 
-	virtual bool addProxy(int set, string proxy);
+	/**
+	 * @param[in]	set	Proxy set to add to, also added to the default set -1.
+	 * @param[in]	proxy	Proxy as [socks5://|http://][user:password@]host:port,
+	 *	SOCKS5 if no protocol is given. A comma separated list of those is a
+	 *	chain, each proxy connecting to the next one and the last to the target.
+	 * @param[in]	optimistic	The SOCKS5 proxies are known to accept the
+	 *	authentication implied by proxy, so the handshakes can be sent in one go.
+	 */
+	virtual bool addProxy(int set, string proxy, bool optimistic = false);
 	virtual void activateSet(int set);
 	
+	//! Choose proxies of the given set by another policy than round robin.
+	virtual void setSelection(int set, ProxySelection selection);
+	
+	/**
+	 * Give up on proxy handshakes not completed in time, counting them as
+	 * failures of the proxy. Requires a TimeoutManager.
+	 * @param[in]	seconds	Timeout of each handshake, 0 to wait for TCP.
+	 */
+	inline void setHandshakeTimeout(unsigned int seconds)
+	{ m_handshakeTimeout = seconds; }
+	
+	/**
+	 * Keep sessions with proxies of the given set connected and authenticated,
+	 * so that connections through them only have to send the CONNECT. Taken
+	 * or lost sessions are replaced right away or, without a TimeoutManager,
+	 * with the next connection.
+	 * @param[in]	set	Proxy set, sessions are used while it is active.
+	 * @param[in]	sessions	Number of sessions to keep ready, 0 for none.
+	 */
+	virtual void setWarmSessions(int set, uint32_t sessions);
+	
+	virtual void timeoutFired(Timeout timeout);
+	
 	virtual void clearProxies(void);
 	virtual bool usesProxies(void);
 
@@ -55,7 +187,41 @@ public:
 
 
 protected:
+	//! The proxy for the next connection, overriding this still takes effect
+	//! unless the active set chooses by affinity.
 	virtual struct ProxyAddress getNextProxy(void);
+	//! As above, for a connection to remoteNode.
+	virtual struct ProxyAddress getNextProxy(const NetworkNode * remoteNode);
+	
+	//! Try an ejected proxy with a connection of its own.
+	void probeProxy(const ProxyAddress& proxy);
+	
+	//! Keep an HTTP proxy connection left idle by a refused CONNECT for the next one.
+	void parkConnection(ProxiedTcpSocket * socket);
+	//! Forget an idle proxy connection, it is closing.
+	void unparkConnection(ProxiedTcpSocket * socket);
+	//! An idle connection to the given proxy, if any, no longer kept.
+	ProxiedTcpSocket * takeIdleConnection(const ProxyAddress& proxy);
+	
+	//! A warm session of its set is authenticated and waits for a target.
+	void sessionReady(ProxiedTcpSocket * socket);
+	//! A warm session closes before it was taken.
+	void sessionLost(ProxiedTcpSocket * socket);
+	//! Close all warm sessions, for the proxies are going away.
+	void closeWarmSessions();
+	//! Key of the proxy in m_proxyHealth and m_idleConnections.
+	static inline uint64_t proxyKey(const ProxyAddress& proxy)
+	{ return ((uint64_t) proxy.host << 16) | proxy.port; }
+	
+	//! xorshift, good enough to pick proxies.
+	inline uint32_t nextRandom()
+	{
+		m_random ^= m_random << 13;
+		m_random ^= m_random >> 17;
+		m_random ^= m_random << 5;
+		
+		return m_random;
+	}
 
 
 private:
@@ -63,23 +229,65 @@ private:
 	class ProxySet
 	{
 	public:
-		ProxySet& operator=(ProxySet const& other)
+		ProxySet()
 		{
-			proxies = other.proxies;
-			nextProxy = proxies.end();
+			id = 0;
+			nextProxy = 0;
+			selection = PROXY_ROUND_ROBIN;
 			
-			return * this;
+			warmSessions = 0;
 		}
 		
-		list<ProxyAddress> proxies;
-		list<ProxyAddress>::iterator nextProxy;
+		//! Key of the set in m_proxyPool.
+		int id;
+		vector<ProxyAddress> proxies;
+		//! Index of the proxy round robin tries next.
+		uint32_t nextProxy;
+		ProxySelection selection;
+		
+		//! Warm sessions to keep, those authenticating and those ready.
+		uint32_t warmSessions;
+		list<ProxiedTcpSocket *> warming;
+		list<ProxiedTcpSocket *> ready;
 	};
 	
+	//! Choose among the proxies of the set by its selection policy.
+	const struct ProxyAddress& chooseProxy(ProxySet& set, const NetworkNode * remoteNode = NULL);
+	//! Is the proxy healthy? An ejected one whose time is up gets probed.
+	bool isUsable(const ProxyAddress& proxy);
+	
+	/**
+	 * A ready warm session of the set, if any, which is then replaced. One
+	 * with the given proxy is preferred, sets choosing by affinity give out
+	 * no other. Sessions with ejected proxies are closed on the way.
+	 */
+	ProxiedTcpSocket * takeWarmSession(ProxySet& set, const ProxyAddress& proxy);
+	//! Start warm sessions until the set has as many as configured.
+	void replenishSessions(ProxySet& set);
+	//! Parse a single proxy of the form given to addProxy, without health.
+	static bool parseProxy(string spec, ProxyAddress& address);
+	
 	typedef unordered_map<int, ProxySet> ProxyPool;
 	
 	ProxyPool m_proxyPool;
 	
 	int m_currentSet;
+	//! The current set, NULL until it has proxies.
+	ProxySet * m_activeSet;
+	
+	//! Later proxies of chains, referred to by ProxyAddress::nextHop.
+	list<ProxyAddress> m_proxyHops;
+	
+	//! Health by proxy address and port, kept when the proxies are cleared.
+	map<uint64_t, ProxyHealth> m_proxyHealth;
+	//! Idle HTTP proxy connections by proxy address and port.
+	map<uint64_t, list<ProxiedTcpSocket *> > m_idleConnections;
+	
+	unsigned int m_handshakeTimeout;
+	uint32_t m_random;
+	
+	//! Refills pools which lost sessions.
+	Timeout m_warmTimer;
 };
 
 
@@ -92,6 +300,11 @@ enum proxyConnectionStatus_e {
 	PROXY_SEND_CONN,	// sending CONNECT command
 	PROXY_WAIT_CONN,	// waiting for CONNECT OK
 
+	PROXY_WAIT_HTTP,	// waiting for the HTTP CONNECT response header
+	PROXY_SKIP_HTTP_BODY,	// skipping the body of a refused HTTP CONNECT
+	PROXY_IDLE,		// HTTP proxy connection kept for the next CONNECT
+	PROXY_READY,		// warm session, authenticated and waiting for a target
+
 	PROXY_DONE		// all done.
 };
 
@@ -99,13 +312,44 @@ enum proxyConnectionStatus_e {
 // proxy-enabled version of TcpSocket
 class ProxiedTcpSocket : public TcpSocket, public NetworkEndpoint
 {
+	friend class ProxiedNetworkManager;
+	
 public:
 	// TcpSocket functionality:
 	ProxiedTcpSocket(void);
-	ProxiedTcpSocket(IOManager * ioManager, NetworkEndpoint * clientEndpoint, struct ProxyAddress proxy);
+	/**
+	 * @param[in]	probe	Only check whether the proxy is alive and close
+	 *	again once it answered the greeting, for the proxy's health.
+	 */
+	ProxiedTcpSocket(IOManager * ioManager, NetworkEndpoint * clientEndpoint, struct ProxyAddress proxy,
+		bool probe = false);
 	virtual ~ProxiedTcpSocket(void);
 
 	virtual bool connect(struct sockaddr_in * remoteHost);
+	/**
+	 * Connect to a target given by IPv4 or IPv6 address or by host name,
+	 * the latter two are passed on to the proxy as they are.
+	 */
+	bool connect(const NetworkNode * remoteNode);
+	/**
+	 * Connect and authenticate to the proxy only, as warm session of the given
+	 * set. The target follows with reuse.
+	 */
+	bool connectWarm(int set);
+	/**
+	 * Send a CONNECT over an idle HTTP proxy connection or a ready warm
+	 * session, see ProxiedNetworkManager::takeIdleConnection.
+	 */
+	bool reuse(NetworkEndpoint * clientEndpoint, const NetworkNode * remoteNode);
+	virtual bool close(bool force = false);
+	
+	virtual void timeoutFired(Timeout timeout);
+	
+	inline void setHandshakeTimeout(unsigned int seconds)
+	{ m_handshakeTimeout = seconds; }
+	
+	inline const struct ProxyAddress& getProxy()
+	{ return m_proxy; }
 
 	// NetworkEndpoint functionality: (for proxy negotiation)
 	virtual void dataRead(const char * buffer, uint32_t dataLength);
@@ -115,23 +359,96 @@ public:
 	virtual void connectionLost(void);
 
 protected:
-	virtual void pivotEndpoints(NetworkNode * proxyNode, char * buffer, uint32_t dataLength);
+	virtual void pivotEndpoints(NetworkNode * proxyNode, const char * buffer, uint32_t dataLength);
+	
+	//! Take the final address from remoteNode, false if it cannot be sent or is no plain host name.
+	bool setDestination(const NetworkNode * remoteNode);
+	//! Count a handshake as in progress for the proxy's health.
+	void startHandshake();
+	//! The proxy accepted us, ask for the target or wait for one as warm session.
+	void authenticated(bool requestSent);
+	
+	//! Write the user/password authentication for the hop into buffer, returns its length.
+	uint32_t buildAuthentication(char * buffer, uint32_t index);
+	//! Write the CONNECT request of the hop into buffer, returns its length.
+	uint32_t buildRequest(char * buffer, uint32_t index);
+	
+	//! Does the hop have a proxy or the final target to connect to yet?
+	inline bool hasTarget(uint32_t index)
+	{ return index + 1 < m_hops.size() || m_remoteType; }
+	//! Send the hop's greeting, true if its CONNECT went along.
+	bool sendOpening(uint32_t index);
+	//! Send the next hop's opening and those which may follow it right away.
+	void sendOpenings();
+	//! Wait for the current hop's answers, sending its opening if not done.
+	void expectHop();
+	
+	inline const struct ProxyAddress& hop()
+	{ return m_hops[m_hop]; }
+	
+	enum HandshakeOutcome
+	{
+		HANDSHAKE_SUCCEEDED,
+		HANDSHAKE_FAILED,
+		//! Closed by the user, nothing learned about the proxy.
+		HANDSHAKE_ABANDONED,
+	};
+	
+	//! Account the handshake to the proxy's health, only the first call counts.
+	void finishHandshake(HandshakeOutcome outcome);
+	
+	// HTTP CONNECT negotiation, see HttpConnect.cpp
+	void sendHttpConnect(uint32_t index);
+	void httpDataRead(const char * buffer, uint32_t dataLength);
+	//! Evaluate a status or header line, false if the response is malformed.
+	bool httpHeaderLine(const char * line, uint32_t length);
+	//! The response header is complete, data follows it.
+	void httpHeaderComplete(const char * data, uint32_t dataLength);
 
 private:
 	// using a proxy for this connection?
 	bool m_useProxy;
-	// proxy address
+	// proxy address, the first one of the chain
 	struct ProxyAddress m_proxy;
+	// chain of proxies, the one negotiating with and those sent an opening
+	vector<ProxyAddress> m_hops;
+	uint32_t m_hop;
+	uint32_t m_hopsSent;
 	// status of proxy negotiation
 	enum proxyConnectionStatus_e m_proxyStatus;
-	// I/O buffer for endpoint
-	char *m_buffer;
+	// start of a reply split across reads
+	char m_buffer[SOCKS5_REPLIES_MAX];
 	uint32_t m_bufferLength;
 
-	// final address of connection
+	// final address of connection, the port is used for all types
 	struct sockaddr_in m_remoteHost;
+	struct in6_addr m_remoteHost6;
+	string m_remoteName;
+	// SOCKS5 address type of the final address
+	uint8_t m_remoteType;
 	// final endpoint
 	NetworkEndpoint	* m_finalClientEndpoint;
+	
+	bool m_probe;
+	bool m_handshakeFinished;
+	uint64_t m_handshakeStarted;
+	unsigned int m_handshakeTimeout;
+	Timeout m_handshakeTimer;
+	
+	// set while the final endpoint could delete us
+	bool * m_destroyed;
+	
+	// HTTP CONNECT response status, 0 before the status line
+	uint32_t m_httpStatus;
+	// the proxy keeps the connection open after refusing
+	bool m_httpKeepAlive;
+	// Content-Length given, and the part of the body not yet skipped
+	bool m_httpBodyKnown;
+	uint32_t m_httpBodyLeft;
+	
+	// warm session of the set, until taken
+	int m_warmSet;
+	bool m_warm;
 };
 
 } // end namespace libnetworkd
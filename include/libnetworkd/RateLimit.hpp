@@ -0,0 +1,93 @@
+/*
+ * RateLimit.hpp - token bucket based traffic shaping
+ * $Id$
+ *
+ * This code is distributed governed by the terms listed in the LICENSE file in
+ * the top directory of this source package.
+ *
+ * (c) 2009 by Georg 'oxff' Wicherski, <gw@mwcollect.org>
+ *
+ */
+
+
+#ifndef __INCLUDE_libnetworkd_RateLimit_hpp
+#define __INCLUDE_libnetworkd_RateLimit_hpp
+
+#include <stdint.h>
+
+
+namespace libnetworkd
+{
+
+
+/**
+ * Token bucket with one token per byte. Tokens are refilled lazily from the
+ * monotonic clock whenever the bucket is queried, so an idle bucket costs
+ * nothing. A bucket with a rate of zero is unlimited.
+ */
+class TokenBucket
+{
+public:
+	TokenBucket();
+
+	/**
+	 * Change the limit, the bucket starts out full.
+	 * @param[in]	rate	Sustained rate in bytes per second, 0 for unlimited.
+	 * @param[in]	burst	Capacity of the bucket in bytes.
+	 */
+	void configure(uint32_t rate, uint32_t burst);
+
+	//! Number of bytes that may be transferred right now.
+	inline uint32_t available()
+	{
+		if(!m_rate)
+			return (uint32_t) -1;
+
+		refill();
+		return m_tokens;
+	}
+
+	inline void consume(uint32_t length)
+	{
+		if(m_rate)
+			m_tokens = length < m_tokens ? m_tokens - length : 0;
+	}
+
+	inline bool isLimited()
+	{ return m_rate != 0; }
+
+	inline uint32_t getRate()
+	{ return m_rate; }
+
+private:
+	void refill();
+
+	uint32_t m_rate;
+	uint32_t m_burst;
+	uint32_t m_tokens;
+
+	uint64_t m_updated;
+};
+
+
+/**
+ * Read and write limit of a connection or of a group of connections sharing
+ * an aggregate limit, e.g. all connections of a listening socket or all
+ * connections from one remote /24. Shared limits are reference counted by
+ * their connections.
+ */
+struct TrafficLimit
+{
+	TrafficLimit()
+	{ references = 1; }
+
+	TokenBucket read;
+	TokenBucket write;
+
+	uint32_t references;
+};
+
+
+}
+
+#endif // __INCLUDE_libnetworkd_RateLimit_hpp
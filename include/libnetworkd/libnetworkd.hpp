@@ -16,16 +16,20 @@
 #define LIBNETWORKD_VERSION_STRING	"1.0"
 
 
+#include "AddressTable.hpp"
 #include "Configuration.hpp"
 #include "Event.hpp"
 #include "EventManager.hpp"
+#include "Framing.hpp"
 #include "IO.hpp"
 #include "LogFacility.hpp"
 #include "LogManager.hpp"
+#include "Memory.hpp"
 #include "ModuleManager.hpp"
 #include "NameResolution.hpp"
 #include "Network.hpp"
 #include "ProxiedNetwork.hpp"
+#include "RateLimit.hpp"
 #include "TimeoutManager.hpp"
 
 #endif // #ifndef __INCLUDE_libnetworkd_libnetworkd_hpp
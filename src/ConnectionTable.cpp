@@ -0,0 +1,131 @@
+/*
+ * ConnectionTable.cpp - enumeration and ranking of live TCP connections
+ * $Id$
+ *
+ * This code is distributed governed by the terms listed in the LICENSE file in
+ * the top directory of this source package.
+ *
+ * (c) 2009 by Georg 'oxff' Wicherski, <gw@mwcollect.org>
+ *
+ */
+
+#include <libnetworkd/Network.hpp>
+#include <libnetworkd/LogManager.hpp>
+
+
+namespace libnetworkd
+{
+
+
+ConnectionTable::ConnectionTable()
+{
+	m_first = 0;
+	m_size = 0;
+}
+
+
+void ConnectionTable::insert(TcpSocket * socket)
+{
+	ASSERT(!socket->m_previousConnection && !socket->m_nextConnection);
+
+	socket->m_previousConnection = 0;
+	socket->m_nextConnection = m_first;
+
+	if(m_first)
+		m_first->m_previousConnection = socket;
+
+	m_first = socket;
+	++m_size;
+}
+
+void ConnectionTable::remove(TcpSocket * socket)
+{
+	if(socket->m_previousConnection)
+		socket->m_previousConnection->m_nextConnection = socket->m_nextConnection;
+	else
+	{
+		ASSERT(m_first == socket);
+		m_first = socket->m_nextConnection;
+	}
+
+	if(socket->m_nextConnection)
+		socket->m_nextConnection->m_previousConnection = socket->m_previousConnection;
+
+	socket->m_previousConnection = socket->m_nextConnection = 0;
+	--m_size;
+}
+
+
+static uint64_t statisticValue(TcpSocket * socket, ConnectionTableKey key,
+	uint64_t now)
+{
+	const NetworkSocketStatistics * statistics = socket->getStatistics();
+
+	switch(key)
+	{
+	case CONNKEY_BYTES_READ:
+		return statistics->bytesRead;
+
+	case CONNKEY_BYTES_SENT:
+		return statistics->bytesSent;
+
+	case CONNKEY_BYTES_TOTAL:
+		return statistics->bytesRead + statistics->bytesSent;
+
+	case CONNKEY_SYSTEM_CALLS:
+		return statistics->systemCalls;
+
+	case CONNKEY_OUTPUT_BUFFER:
+		return socket->getOutputBufferSize();
+
+	case CONNKEY_PEAK_OUTPUT_BUFFER:
+		return statistics->peakOutputBuffer;
+
+	case CONNKEY_IDLE_TIME:
+		return now - statistics->lastActivity;
+	}
+
+	return 0;
+}
+
+uint32_t ConnectionTable::topConsumers(ConnectionTableKey key,
+	TcpSocket ** result, uint32_t count)
+{
+	uint64_t now = ioTimeMillis();
+	uint32_t found = 0;
+
+	if(!count)
+		return 0;
+
+	// insertion into the sorted result, O(size * count) but count is small
+	for(TcpSocket * socket = m_first; socket; socket = socket->m_nextConnection)
+	{
+		uint64_t value = statisticValue(socket, key, now);
+		uint32_t position = found;
+
+		if(found == count)
+		{
+			if(value <= statisticValue(result[count - 1], key, now))
+				continue;
+
+			--position;
+		}
+		else
+			++found;
+
+		for(; position > 0; --position)
+		{
+			if(statisticValue(result[position - 1], key, now) >= value)
+				break;
+
+			result[position] = result[position - 1];
+		}
+
+		result[position] = socket;
+	}
+
+	return found;
+}
+
+
+}
@@ -0,0 +1,335 @@
+/*
+ * FramedEndpoint.cpp - length prefix and delimiter based message framing
+ * $Id$
+ *
+ * This code is distributed governed by the terms listed in the LICENSE file in
+ * the top directory of this source package.
+ *
+ * (c) 2009 by Georg 'oxff' Wicherski, <gw@mwcollect.org>
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <libnetworkd/Framing.hpp>
+#include <libnetworkd/LogManager.hpp>
+
+
+namespace libnetworkd
+{
+
+
+FramedEndpoint::FramedEndpoint(uint8_t prefixLength,
+	FramingByteOrder byteOrder, uint32_t maximumLength)
+	: m_ring(maximumLength + prefixLength)
+{
+	ASSERT(prefixLength == 1 || prefixLength == 2 || prefixLength == 4);
+
+	m_scratch = 0;
+	m_maximumLength = maximumLength;
+
+	m_prefixLength = prefixLength;
+	m_byteOrder = byteOrder;
+
+	m_delimiterLength = 0;
+	m_scanned = 0;
+}
+
+FramedEndpoint::FramedEndpoint(const char * delimiter, uint8_t delimiterLength,
+	uint32_t maximumLength)
+	: m_ring(maximumLength + delimiterLength)
+{
+	ASSERT(delimiterLength > 0 && delimiterLength <= FRAMING_MAX_DELIMITER);
+
+	if(delimiterLength > FRAMING_MAX_DELIMITER)
+		delimiterLength = FRAMING_MAX_DELIMITER;
+
+	m_scratch = 0;
+	m_maximumLength = maximumLength;
+
+	m_prefixLength = 0;
+	m_byteOrder = FRAMING_BIG_ENDIAN;
+
+	memcpy(m_delimiter, delimiter, delimiterLength);
+	m_delimiterLength = delimiterLength;
+	m_scanned = 0;
+}
+
+FramedEndpoint::~FramedEndpoint()
+{
+	if(m_scratch)
+		free(m_scratch);
+}
+
+
+uint32_t FramedEndpoint::decodePrefix(const unsigned char * prefix)
+{
+	uint32_t length = 0;
+
+	if(m_byteOrder == FRAMING_BIG_ENDIAN)
+	{
+		for(uint8_t i = 0; i < m_prefixLength; ++i)
+			length = (length << 8) | prefix[i];
+	}
+	else
+	{
+		for(uint8_t i = m_prefixLength; i > 0; --i)
+			length = (length << 8) | prefix[i - 1];
+	}
+
+	return length;
+}
+
+const char * FramedEndpoint::searchDelimiter(const char * buffer,
+	uint32_t length)
+{
+	// glibc's memchr and memmem are vectorized already
+	if(m_delimiterLength == 1)
+		return (const char *) memchr(buffer, m_delimiter[0], length);
+
+	return (const char *) memmem(buffer, length, m_delimiter,
+		m_delimiterLength);
+}
+
+
+void FramedEndpoint::dataRead(const char * buffer, uint32_t length)
+{
+	while(length)
+	{
+		if(m_ring.empty())
+		{ // nothing pending, frame straight from the read buffer
+			uint32_t consumed;
+
+			if(!frameBuffer(buffer, length, &consumed))
+				return;
+
+			// the incomplete rest is guaranteed to fit into the ring
+			m_ring.write(buffer + consumed, length - consumed);
+
+			if(m_delimiterLength && m_ring.size() >= m_delimiterLength)
+				m_scanned = m_ring.size() - m_delimiterLength + 1;
+
+			return;
+		}
+
+		{
+			uint32_t chunk = m_ring.available();
+
+			if(chunk > length)
+				chunk = length;
+
+			m_ring.write(buffer, chunk);
+
+			buffer += chunk;
+			length -= chunk;
+		}
+
+		if(!frameRing())
+			return;
+	}
+}
+
+bool FramedEndpoint::frameBuffer(const char * buffer, uint32_t length,
+	uint32_t * consumed)
+{
+	* consumed = 0;
+
+	for(;;)
+	{
+		uint32_t messageLength, frameLength;
+		const char * message;
+
+		if(m_prefixLength)
+		{
+			if(length < m_prefixLength)
+				break;
+
+			messageLength = decodePrefix((const unsigned char *) buffer);
+
+			if(messageLength > m_maximumLength)
+			{
+				framingError();
+				return false;
+			}
+
+			if(length - m_prefixLength < messageLength)
+				break;
+
+			message = buffer + m_prefixLength;
+			frameLength = m_prefixLength + messageLength;
+		}
+		else
+		{
+			const char * delimiter = searchDelimiter(buffer, length);
+
+			if(!delimiter)
+			{ // the rest might still end with a partial delimiter
+				if(length > m_maximumLength + m_delimiterLength - 1)
+				{
+					framingError();
+					return false;
+				}
+
+				break;
+			}
+
+			if((messageLength = delimiter - buffer) > m_maximumLength)
+			{
+				framingError();
+				return false;
+			}
+
+			message = buffer;
+			frameLength = messageLength + m_delimiterLength;
+		}
+
+		if(!messageRead(message, messageLength))
+			return false;
+
+		buffer += frameLength;
+		length -= frameLength;
+		* consumed += frameLength;
+	}
+
+	return true;
+}
+
+bool FramedEndpoint::frameRing()
+{
+	for(;;)
+	{
+		if(m_prefixLength)
+		{
+			unsigned char prefix[4];
+			uint32_t messageLength;
+
+			if(m_ring.size() < m_prefixLength)
+				break;
+
+			m_ring.copy(0, (char *) prefix, m_prefixLength);
+			messageLength = decodePrefix(prefix);
+
+			if(messageLength > m_maximumLength)
+			{
+				m_ring.clear();
+				framingError();
+
+				return false;
+			}
+
+			if(m_ring.size() - m_prefixLength < messageLength)
+				break;
+
+			if(!deliverRing(m_prefixLength, messageLength))
+				return false;
+
+			m_ring.consume(m_prefixLength + messageLength);
+		}
+		else
+		{
+			uint32_t messageLength;
+
+			if(!findDelimiter(&messageLength))
+			{
+				if(m_ring.size() <= m_maximumLength + m_delimiterLength - 1)
+					break;
+
+				messageLength = m_ring.size();
+			}
+
+			if(messageLength > m_maximumLength)
+			{
+				m_ring.clear();
+				m_scanned = 0;
+				framingError();
+
+				return false;
+			}
+
+			if(!deliverRing(0, messageLength))
+				return false;
+
+			m_ring.consume(messageLength + m_delimiterLength);
+			m_scanned = 0;
+		}
+	}
+
+	return true;
+}
+
+bool FramedEndpoint::deliverRing(uint32_t offset, uint32_t length)
+{
+	uint32_t contiguous;
+	const char * message = m_ring.peek(offset, &contiguous);
+
+	if(contiguous >= length)
+		return messageRead(message, length);
+
+	if(!m_scratch)
+		m_scratch = (char *) malloc(m_maximumLength);
+
+	m_ring.copy(offset, m_scratch, length);
+	return messageRead(m_scratch, length);
+}
+
+bool FramedEndpoint::findDelimiter(uint32_t * position)
+{
+	uint32_t size = m_ring.size();
+	uint32_t first, second;
+	const char * data;
+	const char * hit;
+
+	if(size < m_scanned + m_delimiterLength)
+		return false;
+
+	// the unscanned data is at most split into two contiguous parts
+	data = m_ring.peek(m_scanned, &first);
+
+	if((hit = searchDelimiter(data, first)))
+	{
+		* position = m_scanned + (hit - data);
+		return true;
+	}
+
+	second = size - m_scanned - first;
+
+	if(second)
+	{
+		if(m_delimiterLength > 1)
+		{ // delimiter straddling the end of the ring
+			char seam[2 * FRAMING_MAX_DELIMITER];
+			uint32_t start = m_scanned, length;
+
+			if(first > (uint32_t) m_delimiterLength - 1)
+				start += first - (m_delimiterLength - 1);
+
+			length = size - start;
+
+			if(length > 2 * ((uint32_t) m_delimiterLength - 1))
+				length = 2 * (m_delimiterLength - 1);
+
+			m_ring.copy(start, seam, length);
+
+			if((hit = searchDelimiter(seam, length)))
+			{
+				* position = start + (hit - seam);
+				return true;
+			}
+		}
+
+		data = m_ring.peek(m_scanned + first, &second);
+
+		if((hit = searchDelimiter(data, second)))
+		{
+			* position = m_scanned + first + (hit - data);
+			return true;
+		}
+	}
+
+	m_scanned = size - m_delimiterLength + 1;
+	return false;
+}
+
+
+}
@@ -0,0 +1,341 @@
+/*
+ * Handoff.cpp - passing listening sockets on to a restarted process
+ * $Id$
+ *
+ * This code is distributed governed by the terms listed in the LICENSE file in
+ * the top directory of this source package.
+ *
+ * (c) 2009 by Georg 'oxff' Wicherski, <gw@mwcollect.org>
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <vector>
+
+#include <libnetworkd/Network.hpp>
+
+
+//! Seconds the new process waits for the old one to send its listeners.
+#define HANDOFF_TIMEOUT 5
+
+/*
+ * The old process sends one "listener <address>\n" line per listening
+ * socket, each carrying its descriptor, followed by "end\n". The new process
+ * answers with "ready\n" once it accepts on them.
+ */
+
+namespace libnetworkd
+{
+
+
+//! Identify a listener by its local address, the same in both processes.
+static string handoffKey(const struct sockaddr * address)
+{
+	if(address->sa_family == AF_INET)
+	{
+		const struct sockaddr_in * in = (const struct sockaddr_in *) address;
+		char port[8];
+
+		snprintf(port, sizeof(port), "%u", ntohs(in->sin_port));
+		return string("tcp ") + inet_ntoa(in->sin_addr) + ":" + port;
+	}
+	else if(address->sa_family == AF_UNIX)
+	{
+		const char * path = ((const struct sockaddr_un *) address)->sun_path;
+
+		// abstract names start with a zero byte, spelled '@' like in makeAddress
+		return path[0] ? string("unix ") + path : string("unix @") + (path + 1);
+	}
+
+	return string();
+}
+
+
+//! Connection of a new process to our handoff socket.
+class HandoffEndpoint : public NetworkEndpoint
+{
+public:
+	HandoffEndpoint(NetworkManager * networkManager, UnixSocket * socket)
+	{
+		m_networkManager = networkManager;
+		m_socket = socket;
+		m_completed = false;
+	}
+
+	virtual void connectionEstablished(NetworkNode * remoteNode, NetworkNode * localNode)
+	{
+		m_networkManager->handOffListeners(m_socket);
+	}
+
+	virtual void dataRead(const char * buffer, uint32_t dataLength)
+	{
+		m_input.append(buffer, dataLength);
+
+		if(!m_completed && m_input.find("ready\n") != string::npos)
+		{
+			m_completed = true;
+			m_networkManager->finishHandoff(true);
+		}
+	}
+
+	virtual void connectionClosed()
+	{
+		if(!m_completed)
+			m_networkManager->finishHandoff(false);
+	}
+
+private:
+	NetworkManager * m_networkManager;
+	UnixSocket * m_socket;
+
+	string m_input;
+	bool m_completed;
+};
+
+class HandoffEndpointFactory : public NetworkEndpointFactory
+{
+public:
+	HandoffEndpointFactory(NetworkManager * networkManager)
+	{ m_networkManager = networkManager; }
+
+	virtual NetworkEndpoint * createEndpoint(NetworkSocket * clientSocket)
+	{ return new HandoffEndpoint(m_networkManager, (UnixSocket *) clientSocket); }
+
+private:
+	NetworkManager * m_networkManager;
+};
+
+
+bool NetworkManager::serveHandoff(const char * path, HandoffHandler * handler)
+{
+	if(m_handoffServer)
+		return false;
+
+	// the socket of the previous generation is of no use anymore
+	if(path[0] != '@')
+		unlink(path);
+
+	if(!m_handoffFactory)
+		m_handoffFactory = new HandoffEndpointFactory(this);
+
+	m_handoffHandler = handler;
+	return (m_handoffServer = serverUnix(path, m_handoffFactory, 1)) != 0;
+}
+
+void NetworkManager::handOffListeners(UnixSocket * socket)
+{
+	for(TcpSocket * listener = m_connectionTable.getFirst(); listener;
+		listener = listener->getNextConnection())
+	{
+		struct sockaddr_storage address;
+		socklen_t len = sizeof(address);
+		string line;
+		int descriptor;
+
+		if(!listener->isServer() || (NetworkSocket *) listener == m_handoffServer)
+			continue;
+
+		descriptor = listener->getDescriptor();
+		memset(&address, 0, sizeof(address));
+
+		if(getsockname(descriptor, (struct sockaddr *) &address, &len) < 0)
+			continue;
+
+		line = "listener " + handoffKey((struct sockaddr *) &address) + "\n";
+		socket->sendDescriptors(&descriptor, 1, line.data(), line.size());
+	}
+
+	socket->send("end\n", 4);
+}
+
+void NetworkManager::finishHandoff(bool completed)
+{
+	std::vector<TcpSocket *> listeners;
+	HandoffHandler * handler = m_handoffHandler;
+
+	if(!completed)
+	{
+		if(handler)
+			handler->handoffAborted();
+
+		return;
+	}
+
+	for(TcpSocket * listener = m_connectionTable.getFirst(); listener;
+		listener = listener->getNextConnection())
+	{
+		if(listener->isServer())
+			listeners.push_back(listener);
+	}
+
+	// the new process holds the same sockets, their queues stay intact
+	for(std::vector<TcpSocket *>::iterator it = listeners.begin(); it != listeners.end(); ++it)
+		(* it)->close(true);
+
+	m_handoffServer = 0;
+	m_handoffHandler = 0;
+
+	if(handler)
+		handler->handoffCompleted();
+}
+
+
+uint32_t NetworkManager::inheritListeners(const char * path)
+{
+	struct sockaddr_un address;
+	socklen_t addressLen = UnixSocket::makeAddress(&address, path);
+	struct timeval timeout;
+	std::vector<int> descriptors;
+	string input;
+	uint32_t inherited = 0;
+	size_t position = 0;
+	int handoffSocket, flags = 0;
+
+	if(m_handoffSocket >= 0)
+		return 0;
+
+	timeout.tv_sec = HANDOFF_TIMEOUT;
+	timeout.tv_usec = 0;
+
+	#ifdef MSG_CMSG_CLOEXEC
+	flags |= MSG_CMSG_CLOEXEC;
+	#endif
+
+	if((handoffSocket = ::socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return 0;
+
+	if(setsockopt(handoffSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0
+		|| ::connect(handoffSocket, (struct sockaddr *) &address, addressLen) != 0)
+	{
+		::close(handoffSocket);
+		return 0;
+	}
+
+	// keys may end in "end" as well, only a line of its own ends the listeners
+	while(input != "end\n" && (input.size() < 5 || input.compare(input.size() - 5, 5, "\nend\n")))
+	{
+		union
+		{
+			char buffer[CMSG_SPACE(sizeof(int) * UNIX_MAX_DESCRIPTORS)];
+			struct cmsghdr align;
+		} control;
+		char buffer[1024];
+		struct iovec vector;
+		struct msghdr header;
+		int read;
+
+		vector.iov_base = buffer;
+		vector.iov_len = sizeof(buffer);
+
+		memset(&header, 0, sizeof(header));
+		header.msg_iov = &vector;
+		header.msg_iovlen = 1;
+		header.msg_control = &control;
+		header.msg_controllen = sizeof(control);
+
+		if((read = recvmsg(handoffSocket, &header, flags)) <= 0)
+		{
+			if(read < 0 && errno == EINTR)
+				continue;
+
+			for(std::vector<int>::iterator it = descriptors.begin(); it != descriptors.end(); ++it)
+				::close(* it);
+
+			::close(handoffSocket);
+			return 0;
+		}
+
+		for(struct cmsghdr * message = CMSG_FIRSTHDR(&header); message;
+			message = CMSG_NXTHDR(&header, message))
+		{
+			if(message->cmsg_level == SOL_SOCKET && message->cmsg_type == SCM_RIGHTS)
+			{
+				uint32_t count = (message->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+				int descriptor;
+
+				for(uint32_t i = 0; i < count; ++i)
+				{
+					memcpy(&descriptor, CMSG_DATA(message) + i * sizeof(int), sizeof(int));
+					descriptors.push_back(descriptor);
+				}
+			}
+		}
+
+		input.append(buffer, read);
+	}
+
+	// descriptors and lines are both in the order the listeners were sent
+	for(std::vector<int>::iterator it = descriptors.begin(); it != descriptors.end(); ++it)
+	{
+		size_t end = input.find('\n', position);
+		string line = input.substr(position, end - position);
+
+		position = end + 1;
+
+		if(line.compare(0, 9, "listener ") || m_inheritedListeners.count(line.substr(9)))
+		{
+			::close(* it);
+			continue;
+		}
+
+		m_inheritedListeners[line.substr(9)] = * it;
+		++inherited;
+	}
+
+	m_handoffSocket = handoffSocket;
+	return inherited;
+}
+
+int NetworkManager::takeInheritedListener(const struct sockaddr * address)
+{
+	map<string, int>::iterator it;
+	int descriptor;
+
+	if(m_inheritedListeners.empty())
+		return -1;
+
+	if((it = m_inheritedListeners.find(handoffKey(address))) == m_inheritedListeners.end())
+		return -1;
+
+	descriptor = it->second;
+	m_inheritedListeners.erase(it);
+
+	return descriptor;
+}
+
+bool NetworkManager::completeHandoff()
+{
+	bool completed;
+
+	if(m_handoffSocket < 0)
+		return false;
+
+	// nobody would accept on them, let the old process' close drop them
+	for(map<string, int>::iterator it = m_inheritedListeners.begin();
+		it != m_inheritedListeners.end(); ++it)
+	{
+		::close(it->second);
+	}
+
+	m_inheritedListeners.clear();
+
+	completed = (write(m_handoffSocket, "ready\n", 6) == 6);
+
+	::close(m_handoffSocket);
+	m_handoffSocket = -1;
+
+	return completed;
+}
+
+
+}
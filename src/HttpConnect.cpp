@@ -0,0 +1,285 @@
+/*
+ * HttpConnect.cpp - HTTP CONNECT negotiation of ProxiedTcpSocket
+ * $Id$
+ *
+ * This code is distributed governed by the terms listed in the LICENSE file in
+ * the top directory of this source package.
+ *
+ * (c) 2009 by Georg 'oxff' Wicherski, <gw@mwcollect.org>
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <libnetworkd/Network.hpp>
+#include <libnetworkd/ProxiedNetwork.hpp>
+
+
+//! Longest CONNECT request, with a 255 byte host name and credentials.
+#define HTTP_CONNECT_MAX 2048
+
+
+namespace libnetworkd
+{
+
+
+static const char base64Alphabet[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+//! Base64 of the given bytes into output, returns the length written.
+static uint32_t base64Encode(const unsigned char * input, uint32_t length, char * output)
+{
+	char * start = output;
+
+	for(uint32_t i = 0; i < length; i += 3) {
+		uint32_t block = input[i] << 16;
+
+		if(i + 1 < length)
+			block |= input[i + 1] << 8;
+		if(i + 2 < length)
+			block |= input[i + 2];
+
+		*output++ = base64Alphabet[(block >> 18) & 0x3f];
+		*output++ = base64Alphabet[(block >> 12) & 0x3f];
+		*output++ = i + 1 < length ? base64Alphabet[(block >> 6) & 0x3f] : '=';
+		*output++ = i + 2 < length ? base64Alphabet[block & 0x3f] : '=';
+	}
+
+	return output - start;
+}
+
+//! Does the header line start with the given name and a colon?
+static bool isHeader(const char * line, uint32_t length, const char * name)
+{
+	uint32_t nameLength = strlen(name);
+
+	return length > nameLength && line[nameLength] == ':' && !strncasecmp(line, name, nameLength);
+}
+
+
+void ProxiedTcpSocket::sendHttpConnect(uint32_t index)
+{
+	const struct ProxyAddress& proxy = m_hops[index];
+	char message[HTTP_CONNECT_MAX];
+	char target[4 + 255 + 8];
+	int length;
+
+	if(index + 1 < m_hops.size()) {
+		// through to the next proxy of the chain
+		struct in_addr adr;
+
+		adr.s_addr = m_hops[index + 1].host;
+		snprintf(target, sizeof(target), "%s:%u", inet_ntoa(adr), ntohs(m_hops[index + 1].port));
+	} else {
+		// IPv6 addresses are bracketed like in URLs
+		snprintf(target, sizeof(target), m_remoteType == 4 ? "[%s]:%u" : "%s:%u",
+			m_remoteName.c_str(), ntohs(m_remoteHost.sin_port));
+	}
+
+	length = snprintf(message, sizeof(message), "CONNECT %s HTTP/1.1\r\nHost: %s\r\n", target, target);
+
+	if(!proxy.user.empty()) {
+		unsigned char credentials[255 + 1 + 255];
+		uint32_t ulen = proxy.user.length(), plen = proxy.password.length();
+
+		memcpy(credentials, proxy.user.data(), ulen);
+		credentials[ulen] = ':';
+		memcpy(credentials + ulen + 1, proxy.password.data(), plen);
+
+		length += snprintf(message + length, sizeof(message) - length, "Proxy-Authorization: Basic ");
+		length += base64Encode(credentials, ulen + 1 + plen, message + length);
+		length += snprintf(message + length, sizeof(message) - length, "\r\n");
+	}
+
+	length += snprintf(message + length, sizeof(message) - length, "\r\n");
+
+	send(message, length);
+}
+
+void ProxiedTcpSocket::httpDataRead(const char * buffer, uint32_t dataLength)
+{
+	uint32_t position = 0;
+
+	if(m_proxyStatus == PROXY_SKIP_HTTP_BODY) {
+		if(dataLength > m_httpBodyLeft) {
+			close(true);
+			return;
+		}
+
+		if(!(m_httpBodyLeft -= dataLength)) {
+			m_proxyStatus = PROXY_IDLE;
+			((ProxiedNetworkManager *) m_networkManager)->parkConnection(this);
+		}
+
+		return;
+	}
+
+	while(position < dataLength) {
+		const char * line = buffer + position;
+		const char * end;
+		uint32_t length, lineLength;
+
+		if(m_proxyStatus != PROXY_WAIT_HTTP) {
+			// an idle proxy has nothing to say, nor anything behind a body
+			finishHandshake(HANDSHAKE_FAILED);
+			close(true);
+			return;
+		}
+
+		end = (const char *) memchr(line, '\n', dataLength - position);
+		length = (end ? end + 1 - line : dataLength - position);
+		position += length;
+
+		if(!end || m_bufferLength) {
+			// lines are parsed in place unless split across reads; longer
+			// lines than the buffer are cut, none we look at is that long
+			uint32_t copied = sizeof(m_buffer) - m_bufferLength;
+
+			if(copied > length)
+				copied = length;
+
+			memcpy(m_buffer + m_bufferLength, line, copied);
+			m_bufferLength += copied;
+
+			if(!end)
+				return;
+
+			line = m_buffer;
+			length = m_bufferLength;
+			m_bufferLength = 0;
+		}
+
+		lineLength = length;
+
+		while(lineLength && (line[lineLength - 1] == '\n' || line[lineLength - 1] == '\r'))
+			--lineLength;
+
+		if(lineLength == 0 && m_httpStatus) {
+			httpHeaderComplete(buffer + position, dataLength - position);
+			return;
+		}
+
+		if(!httpHeaderLine(line, lineLength)) {
+			finishHandshake(HANDSHAKE_FAILED);
+			close(true);
+			return;
+		}
+	}
+}
+
+bool ProxiedTcpSocket::httpHeaderLine(const char * line, uint32_t length)
+{
+	const char * value;
+
+	if(!m_httpStatus) {
+		// HTTP/1.x nnn reason
+		if(length < 12 || strncmp(line, "HTTP/1.", 7) || line[8] != ' ')
+			return false;
+
+		m_httpStatus = atoi(line + 9);
+		// persistent unless told otherwise since HTTP/1.1
+		m_httpKeepAlive = (line[7] != '0');
+
+		return m_httpStatus >= 100 && m_httpStatus < 600;
+	}
+
+	if(!(value = (const char *) memchr(line, ':', length)))
+		return false;
+
+	for(++value; value < line + length && (*value == ' ' || *value == '\t'); ++value)
+		;
+
+	if(isHeader(line, length, "Content-Length")) {
+		m_httpBodyKnown = true;
+		m_httpBodyLeft = strtoul(value, NULL, 10);
+	} else if(isHeader(line, length, "Transfer-Encoding")) {
+		// not worth decoding chunks of a refusal to keep the connection
+		m_httpKeepAlive = false;
+	} else if(isHeader(line, length, "Connection") || isHeader(line, length, "Proxy-Connection")) {
+		uint32_t valueLength = line + length - value;
+
+		if(valueLength >= 5 && !strncasecmp(value, "close", 5))
+			m_httpKeepAlive = false;
+		else if(valueLength >= 10 && !strncasecmp(value, "keep-alive", 10))
+			m_httpKeepAlive = true;
+	}
+
+	return true;
+}
+
+void ProxiedTcpSocket::httpHeaderComplete(const char * data, uint32_t dataLength)
+{
+	NetworkEndpoint * endpoint;
+
+	if(m_httpStatus >= 200 && m_httpStatus < 300) {
+		NetworkNode proxyNode;
+		struct in_addr adr;
+
+		if(m_hop + 1 < m_hops.size()) {
+			// through to the next proxy, what follows is its
+			++m_hop;
+			expectHop();
+
+			if(dataLength)
+				dataRead(data, dataLength);
+
+			return;
+		}
+
+		finishHandshake(HANDSHAKE_SUCCEEDED);
+
+		// the proxy does not tell where it connects from, it stands in
+		adr.s_addr = hop().host;
+		proxyNode.name = inet_ntoa(adr);
+		proxyNode.port = ntohs(hop().port);
+
+		m_proxyStatus = PROXY_DONE;
+		pivotEndpoints(&proxyNode, data, dataLength);
+		return;
+	}
+
+	if(m_httpStatus < 200) {
+		// an interim response, the real one follows
+		m_httpStatus = 0;
+		m_httpBodyKnown = false;
+		m_httpBodyLeft = 0;
+
+		httpDataRead(data, dataLength);
+		return;
+	}
+
+	// wrong credentials are the proxy's failure, anything else the target's
+	finishHandshake(m_httpStatus == 407 ? HANDSHAKE_FAILED : HANDSHAKE_SUCCEEDED);
+
+	// only a connection to the proxy itself can be parked, not one through others
+	if(!m_httpKeepAlive || !m_httpBodyKnown || m_httpStatus == 407 || dataLength > m_httpBodyLeft
+		|| !m_networkManager || m_hops.size() > 1) {
+		close(true);
+		return;
+	}
+
+	// refused, but the proxy connection can carry the next CONNECT
+	endpoint = m_finalClientEndpoint;
+	m_finalClientEndpoint = NULL;
+
+	m_httpBodyLeft -= dataLength;
+	m_proxyStatus = PROXY_SKIP_HTTP_BODY;
+
+	if(!m_httpBodyLeft) {
+		m_proxyStatus = PROXY_IDLE;
+		((ProxiedNetworkManager *) m_networkManager)->parkConnection(this);
+	}
+
+	if(endpoint)
+		endpoint->connectionClosed();
+}
+
+
+}
@@ -95,6 +95,8 @@ void IOManager::waitForEventsAndProcess(uint32_t maxwait)
 				pollfds[j].events = POLLIN | POLLERR;
 			else if(i->socket->m_ioSocketState == IOSOCKSTAT_BUFFERING)
 				pollfds[j].events = POLLIN | POLLOUT | POLLERR;
+			else if(i->socket->m_ioSocketState == IOSOCKSTAT_SENDING)
+				pollfds[j].events = POLLOUT | POLLERR;
 			else
 				pollfds[j].events = POLLERR;	
 		}
@@ -115,8 +117,14 @@ void IOManager::waitForEventsAndProcess(uint32_t maxwait)
 			
 		for(m_iterator = m_socketList.begin(); m_iterator != m_socketList.end() && j < c; ++j)
 		{
-			if(m_iterator->fileDescriptor != pollfds[j].fd || i->socket->m_ioSocketState == IOSOCKSTAT_IGNORE)
+			if(m_iterator->fileDescriptor != pollfds[j].fd)
+				continue;
+			
+			if(m_iterator->socket->m_ioSocketState == IOSOCKSTAT_IGNORE)
+			{
+				++m_iterator;
 				continue;
+			}
 			
 			if(pollfds[j].revents & POLLERR)
 				m_iterator->socket->pollError();
@@ -0,0 +1,127 @@
+/*
+ * MemoryArena.cpp - per-connection bump allocator released in bulk
+ * $Id$
+ *
+ * This code is distributed governed by the terms listed in the LICENSE file in
+ * the top directory of this source package.
+ *
+ * (c) 2009 by Georg 'oxff' Wicherski, <gw@mwcollect.org>
+ *
+ */
+
+#include <stdlib.h>
+
+#include <libnetworkd/Memory.hpp>
+
+
+#define ALIGN_SIZE(a) (((a) + MEMORY_ALIGNMENT - 1) & ~((size_t) MEMORY_ALIGNMENT - 1))
+
+//! Size of the blocks shared between all arenas, including the block header.
+#define ARENA_BLOCK_SIZE 4096
+
+
+namespace libnetworkd
+{
+
+
+//! Blocks are shared between all arenas of a thread and never given back to
+//! the system, the pool is intentionally leaked to survive static destruction
+//! order. Each thread has its own, reactors must not share free lists.
+static __thread MemoryPool * g_arenaBlocks = 0;
+
+
+MemoryArena::MemoryArena()
+{
+	m_blocks = 0;
+	m_largeBlocks = 0;
+
+	m_current = 0;
+	m_remaining = 0;
+}
+
+MemoryArena::~MemoryArena()
+{
+	release();
+}
+
+
+void * MemoryArena::allocate(size_t size)
+{
+	size_t header = ALIGN_SIZE(sizeof(Block));
+	char * memory;
+
+	size = ALIGN_SIZE(size ? size : 1);
+
+	if(size <= m_remaining)
+	{
+		memory = m_current;
+
+		m_current += size;
+		m_remaining -= size;
+
+		return memory;
+	}
+
+	if(size > ARENA_BLOCK_SIZE - header)
+	{ // does not fit into a shared block at all, keep the current one going
+		Block * block = (Block *) malloc(header + size);
+
+		if(!block)
+			return 0;
+
+		block->next = m_largeBlocks;
+		m_largeBlocks = block;
+
+		return (char *) block + header;
+	}
+
+	{
+		Block * block;
+
+		if(!g_arenaBlocks)
+			g_arenaBlocks = new MemoryPool(ARENA_BLOCK_SIZE, 16);
+
+		if(!(block = (Block *) g_arenaBlocks->allocate()))
+			return 0;
+
+		block->next = m_blocks;
+		m_blocks = block;
+
+		memory = (char *) block + header;
+
+		m_current = memory + size;
+		m_remaining = ARENA_BLOCK_SIZE - header - size;
+	}
+
+	return memory;
+}
+
+void MemoryArena::release()
+{
+	Block * next;
+
+	// released blocks go to the pool of this thread, which may be another one
+	if(m_blocks && !g_arenaBlocks)
+		g_arenaBlocks = new MemoryPool(ARENA_BLOCK_SIZE, 16);
+
+	for(Block * block = m_blocks; block; block = next)
+	{
+		next = block->next;
+		g_arenaBlocks->release(block);
+	}
+
+	for(Block * block = m_largeBlocks; block; block = next)
+	{
+		next = block->next;
+		free(block);
+	}
+
+	m_blocks = 0;
+	m_largeBlocks = 0;
+
+	m_current = 0;
+	m_remaining = 0;
+}
+
+
+}
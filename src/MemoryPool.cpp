@@ -0,0 +1,95 @@
+/*
+ * MemoryPool.cpp - fixed size object allocator backed by slabs
+ * $Id$
+ *
+ * This code is distributed governed by the terms listed in the LICENSE file in
+ * the top directory of this source package.
+ *
+ * (c) 2009 by Georg 'oxff' Wicherski, <gw@mwcollect.org>
+ *
+ */
+
+#include <stdlib.h>
+
+#include <libnetworkd/Memory.hpp>
+
+
+#define ALIGN_SIZE(a) (((a) + MEMORY_ALIGNMENT - 1) & ~((size_t) MEMORY_ALIGNMENT - 1))
+
+
+namespace libnetworkd
+{
+
+
+MemoryPool::MemoryPool(size_t objectSize, uint32_t objectsPerSlab)
+{
+	if(objectSize < sizeof(FreeObject))
+		objectSize = sizeof(FreeObject);
+
+	m_objectSize = ALIGN_SIZE(objectSize);
+	m_objectsPerSlab = objectsPerSlab ? objectsPerSlab : 1;
+
+	m_freeList = 0;
+	m_slabs = 0;
+}
+
+MemoryPool::~MemoryPool()
+{
+	Slab * next;
+
+	for(Slab * slab = m_slabs; slab; slab = next)
+	{
+		next = slab->next;
+		free(slab);
+	}
+}
+
+
+bool MemoryPool::grow()
+{
+	size_t header = ALIGN_SIZE(sizeof(Slab));
+	Slab * slab = (Slab *) malloc(header + m_objectSize * m_objectsPerSlab);
+
+	if(!slab)
+		return false;
+
+	slab->next = m_slabs;
+	m_slabs = slab;
+
+	// thread the new objects backwards, so they are handed out in address order
+	for(uint32_t i = m_objectsPerSlab; i > 0; --i)
+	{
+		FreeObject * object = (FreeObject *) ((char *) slab + header
+			+ (i - 1) * m_objectSize);
+
+		object->next = m_freeList;
+		m_freeList = object;
+	}
+
+	return true;
+}
+
+void * MemoryPool::allocate()
+{
+	FreeObject * object;
+
+	if(!m_freeList && !grow())
+		return 0;
+
+	object = m_freeList;
+	m_freeList = object->next;
+
+	return (void *) object;
+}
+
+void MemoryPool::release(void * object)
+{
+	if(!object)
+		return;
+
+	((FreeObject *) object)->next = m_freeList;
+	m_freeList = (FreeObject *) object;
+}
+
+
+}
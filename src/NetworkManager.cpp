@@ -12,8 +12,10 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -23,8 +25,94 @@
 namespace libnetworkd
 {
 
+NetworkManager::NetworkManager()
+{
+	m_timeoutManager = 0;
+	m_lingerTimeout = 5;
+
+	m_subnetReadRate = 0;
+	m_subnetWriteRate = 0;
+
+	m_datagramShards = 0;
+	m_datagramCpu = -1;
+
+	m_handoffServer = 0;
+	m_handoffFactory = 0;
+	m_handoffHandler = 0;
+	m_handoffSocket = -1;
+}
+
 NetworkManager::~NetworkManager()
 {
+	for(map<uint32_t, TrafficLimit *>::iterator it = m_subnetLimits.begin();
+		it != m_subnetLimits.end(); ++it)
+	{
+		delete it->second;
+	}
+
+	for(map<string, int>::iterator it = m_inheritedListeners.begin();
+		it != m_inheritedListeners.end(); ++it)
+	{
+		::close(it->second);
+	}
+
+	if(m_handoffSocket >= 0)
+		::close(m_handoffSocket);
+
+	delete m_handoffFactory;
+
+	for(list<NetworkEndpointFactory *>::iterator it = m_sharedRingFactories.begin();
+		it != m_sharedRingFactories.end(); ++it)
+	{
+		delete * it;
+	}
+}
+
+
+void NetworkManager::setSubnetLimit(uint32_t readRate, uint32_t writeRate)
+{
+	m_subnetReadRate = readRate;
+	m_subnetWriteRate = writeRate;
+}
+
+TrafficLimit * NetworkManager::acquireSubnetLimit(const struct sockaddr_in * address)
+{
+	uint32_t subnet = address->sin_addr.s_addr & htonl(0xffffff00);
+	map<uint32_t, TrafficLimit *>::iterator it;
+
+	if((!m_subnetReadRate && !m_subnetWriteRate) || !m_timeoutManager)
+		return 0;
+
+	if((it = m_subnetLimits.find(subnet)) != m_subnetLimits.end())
+	{
+		++it->second->references;
+		return it->second;
+	}
+
+	{
+		TrafficLimit * limit = new TrafficLimit;
+
+		limit->read.configure(m_subnetReadRate, m_subnetReadRate);
+		limit->write.configure(m_subnetWriteRate, m_subnetWriteRate);
+
+		m_subnetLimits[subnet] = limit;
+		return limit;
+	}
+}
+
+void NetworkManager::releaseSubnetLimit(const struct sockaddr_in * address)
+{
+	uint32_t subnet = address->sin_addr.s_addr & htonl(0xffffff00);
+	map<uint32_t, TrafficLimit *>::iterator it = m_subnetLimits.find(subnet);
+
+	if(it == m_subnetLimits.end())
+		return;
+
+	if(!--it->second->references)
+	{
+		delete it->second;
+		m_subnetLimits.erase(it);
+	}
 }
 
 NetworkSocket * NetworkManager::connectStream(const NetworkNode * remoteNode, NetworkEndpoint * localEndpoint,
@@ -40,6 +128,7 @@ NetworkSocket * NetworkManager::connectStream(const NetworkNode * remoteNode, Ne
 		return 0;
 	
 	socket = new TcpSocket(this, localEndpoint);
+	socket->setNetworkManager(this);
 
 	if(localNode)
 	{
@@ -82,6 +171,7 @@ NetworkSocket * NetworkManager::serverStream(const NetworkNode * localNode, Netw
 {
 	struct sockaddr_in localAddress;
 	TcpSocket * socket;
+	int inherited;
 	
 	localAddress.sin_family = AF_INET;
 	localAddress.sin_port = htons(localNode->port);
@@ -94,7 +184,21 @@ NetworkSocket * NetworkManager::serverStream(const NetworkNode * localNode, Netw
 			return 0;
 	}
 	
-	socket = new TcpSocket(this, factory);	
+	socket = new TcpSocket(this, factory);
+	socket->setNetworkManager(this);
+	
+	if((inherited = takeInheritedListener((struct sockaddr *) &localAddress)) >= 0)
+	{
+		if(!socket->adoptListener(inherited))
+		{
+			::close(inherited);
+			socket->close(true);
+			
+			return 0;
+		}
+		
+		return socket;
+	}
 	
 	if(!socket->bind(&localAddress) || !socket->listen(backlog))
 	{
@@ -113,32 +217,81 @@ bool NetworkManager::closeStream(NetworkSocket * tcpSocket, bool force)
 
 
 
-NetworkSocket * NetworkManager::connectUnix(const char * path, NetworkEndpoint * localEndpoint)
+NetworkSocket * NetworkManager::adoptStream(int connectedSocket, NetworkEndpoint * localEndpoint)
+{
+	struct sockaddr_storage address;
+	socklen_t len = sizeof(address);
+	TcpSocket * socket;
+	int type;
+	
+	if(getsockname(connectedSocket, (struct sockaddr *) &address, &len) < 0)
+		return 0;
+	
+	len = sizeof(type);
+	
+	if(getsockopt(connectedSocket, SOL_SOCKET, SO_TYPE, &type, &len) < 0)
+		return 0;
+	
+	if(address.ss_family == AF_UNIX && (type == SOCK_STREAM || type == SOCK_SEQPACKET))
+		socket = new UnixSocket(this, localEndpoint, type);
+	else if(address.ss_family == AF_INET && type == SOCK_STREAM)
+		socket = new TcpSocket(this, localEndpoint);
+	else
+		return 0;
+	
+	socket->setNetworkManager(this);
+	
+	if(!socket->adopt(connectedSocket))
+	{
+		socket->close(true);
+		return 0;
+	}
+	
+	return socket;
+}
+
+NetworkSocket * NetworkManager::connectUnix(const char * path, NetworkEndpoint * localEndpoint, int type)
 {
 	UnixSocket * socket;
 	
-	socket = new UnixSocket(this, localEndpoint);
+	socket = new UnixSocket(this, localEndpoint, type);
+	socket->setNetworkManager(this);
 	
 	if(!socket->connect(path))
 	{
 		socket->close(true);
-		
-		delete socket;
 		return 0;
 	}
 	
 	return socket;
 }
 
-NetworkSocket * NetworkManager::serverUnix(const char * path, NetworkEndpointFactory * factory, uint8_t backlog)
+NetworkSocket * NetworkManager::serverUnix(const char * path, NetworkEndpointFactory * factory, uint8_t backlog,
+	int type)
 {
-	UnixSocket * socket = new UnixSocket(this, factory);
+	UnixSocket * socket = new UnixSocket(this, factory, type);
+	struct sockaddr_un address;
+	int inherited;
+	
+	socket->setNetworkManager(this);
+	UnixSocket::makeAddress(&address, path);
+	
+	if((inherited = takeInheritedListener((struct sockaddr *) &address)) >= 0)
+	{
+		if(!socket->adoptListener(inherited))
+		{
+			::close(inherited);
+			socket->close(true);
+			
+			return 0;
+		}
+		
+		return socket;
+	}
 	
 	if(!socket->bind(path) || !socket->listen(backlog))
 	{
 		socket->close(true);
-		
-		delete socket;
 		return 0;
 	}
 	
@@ -147,16 +300,87 @@ NetworkSocket * NetworkManager::serverUnix(const char * path, NetworkEndpointFac
 
 
 
+UdpSocket * NetworkManager::bindDatagram(const NetworkNode * localNode, bool server)
+{
+	struct sockaddr_in localAddress;
+	UdpSocket ** bound;
+	UdpSocket * socket;
+	
+	localAddress.sin_family = AF_INET;
+	localAddress.sin_port = htons(localNode ? localNode->port : 0);
+	
+	if(!localNode || localNode->name == "any")
+		localAddress.sin_addr.s_addr = INADDR_ANY;
+	else
+	{
+		if(inet_aton(localNode->name.c_str(), &localAddress.sin_addr) == 0)
+			return 0;
+	}
+	
+	// reuse the socket already bound there, if any
+	if(localAddress.sin_port && (bound = m_boundDatagramSockets.find(&localAddress)))
+		return * bound;
+	
+	socket = new UdpSocket(this);
+	
+	if(server && m_datagramShards)
+		socket->setReusePort(true);
+	
+	if(!socket->bind(localAddress))
+	{
+		delete socket;
+		return 0;
+	}
+	
+	// without steering, the kernel still keeps flows on one shard by hash
+	if(server && m_datagramShards && m_datagramCpu >= 0)
+	{
+		socket->setIncomingCpu(m_datagramCpu);
+		socket->steerByCpu(m_datagramShards);
+	}
+	
+	socket->setNetworkManager(this);
+	m_boundDatagramSockets.insert(socket->getLocalAddress(), socket);
+	
+	return socket;
+}
+
 NetworkSocket * NetworkManager::connectDatagram(const NetworkNode * remoteNode, NetworkEndpoint * localEndpoint, const NetworkNode * localNode )
 {
-	// TODO FIXME: implement!
-	return 0;
+	NetworkNode remote = * remoteNode, local;
+	UdpSocketWrapper * wrapper;
+	UdpSocket * socket;
+	
+	if(!(socket = bindDatagram(localNode)))
+		return 0;
+	
+	if(!(wrapper = socket->addEndpoint(remote, localEndpoint)))
+	{
+		// the socket may be shared with other endpoints, only close it if unused
+		if(!socket->getEndpointFactory() && !socket->getPeers())
+			socket->close(true);
+		
+		return 0;
+	}
+	
+	local = socket->getLocalNode();
+	localEndpoint->connectionEstablished(&remote, &local);
+	
+	return wrapper;
 }
 
 NetworkSocket * NetworkManager::serverDatagram(const NetworkNode * localNode, NetworkEndpointFactory * endpointFactory)
 {
-	// TODO FIXME: implement!
-	return 0;
+	UdpSocket * socket;
+	
+	if(!(socket = bindDatagram(localNode, true)))
+		return 0;
+	
+	if(socket->getEndpointFactory() && socket->getEndpointFactory() != endpointFactory)
+		return 0;
+	
+	socket->setEndpointFactory(endpointFactory);
+	return socket;
 }
 
 bool NetworkManager::closeDatagram(NetworkSocket * socket, bool force)
@@ -164,5 +388,13 @@ bool NetworkManager::closeDatagram(NetworkSocket * socket, bool force)
 	return socket->close(force);
 }
 
+void NetworkManager::dropDatagramSocket(const struct sockaddr_in * localAddress, UdpSocket * socket)
+{
+	UdpSocket ** bound = m_boundDatagramSockets.find(localAddress);
+	
+	if(bound && * bound == socket)
+		m_boundDatagramSockets.remove(localAddress);
+}
+
 
 }
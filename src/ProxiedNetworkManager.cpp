@@ -12,6 +12,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -25,101 +26,525 @@ namespace libnetworkd
 {
 
 
+void ProxyHealth::succeeded(uint32_t millis)
+{
+	// smoothed like the TCP round trip time, a new sample weighs 1/8
+	latency = latency ? (latency * 7 + millis) / 8 : millis;
+
+	failures = 0;
+	ejections = 0;
+	ejectedUntil = 0;
+}
+
+void ProxyHealth::failed(uint64_t now)
+{
+	uint32_t seconds;
+
+	// handshakes started before the ejection do not count, only the probe
+	if(ejectedUntil && !probing)
+		return;
+
+	if(!ejectedUntil && ++failures < PROXY_EJECT_FAILURES)
+		return;
+
+	seconds = PROXY_EJECT_TIME << (ejections < 8 ? ejections : 8);
+
+	if(seconds > PROXY_EJECT_MAX)
+		seconds = PROXY_EJECT_MAX;
+
+	ejectedUntil = now + seconds * 1000;
+	++ejections;
+	failures = 0;
+}
+
+
+ProxiedNetworkManager::ProxiedNetworkManager()
+{
+	m_currentSet = 0;
+	m_activeSet = NULL;
+	m_handshakeTimeout = 0;
+	m_warmTimer = TIMEOUT_EMPTY;
+
+	m_random = (uint32_t) time(0) ^ ((uint32_t) getpid() << 16);
+
+	if(!m_random)
+		m_random = 1;
+}
+
 ProxiedNetworkManager::~ProxiedNetworkManager()
 {
-	// nil
+	list<ProxiedTcpSocket *> idle;
+
+	if(m_warmTimer != TIMEOUT_EMPTY)
+		m_timeoutManager->dropTimeout(m_warmTimer);
+
+	closeWarmSessions();
+
+	// closing them unparks them
+	for(map<uint64_t, list<ProxiedTcpSocket *> >::iterator it = m_idleConnections.begin();
+		it != m_idleConnections.end(); ++it)
+	{
+		idle.insert(idle.end(), it->second.begin(), it->second.end());
+	}
+
+	for(list<ProxiedTcpSocket *>::iterator it = idle.begin(); it != idle.end(); ++it)
+		(* it)->close(true);
 }
 
 	// NOTE
-	// proxy-addresses are assumed in number/dots format "[user:passwort@]IP:port", NOT hostnames.
+	// proxy-addresses are assumed in number/dots format "[protocol://][user:passwort@]IP:port", NOT hostnames.
 	// otherwise we will have to use a resolver here.
 
-bool ProxiedNetworkManager::addProxy(int set, string proxy)
+bool ProxiedNetworkManager::parseProxy(string spec, ProxyAddress& address)
 {
-	struct ProxyAddress address;
-	
 	int m;
 	string prefix, postfix;
 	string host, port;
 
-	m = proxy.find_first_of('@',0);
+	if(spec.compare(0, 9, "socks5://") == 0) {
+		address.protocol = PROXY_SOCKS5;
+		spec = spec.substr(9);
+	} else if(spec.compare(0, 7, "http://") == 0) {
+		address.protocol = PROXY_HTTP_CONNECT;
+		spec = spec.substr(7);
+	} else if(spec.find("://") != string::npos) {
+		return false;
+	} else {
+		address.protocol = PROXY_SOCKS5;
+	}
+
+	m = spec.find_first_of('@',0);
 	if(m >= 0) {
-		prefix = proxy.substr(0,m);
-		postfix = proxy.substr(m+1, proxy.length());
+		prefix = spec.substr(0,m);
+		postfix = spec.substr(m+1, spec.length());
 
 		m = prefix.find_first_of(':',0);
 		address.user = prefix.substr(0, m);
 		address.password = prefix.substr(m+1, prefix.length());
 	} else {
-		postfix = proxy;
+		postfix = spec;
 		address.user = string();
 		address.password = string();
 	}
 
 	m = postfix.find_first_of(':',0);
 	host = postfix.substr(0, m);
-	port = postfix.substr(m+1,proxy.length());
+	port = postfix.substr(m+1,postfix.length());
 
 	if(inet_aton(host.c_str(), (struct in_addr *) &address.host) == 0)
 	{
 		return false;
 	}
 	
+	// SOCKS5 has a single byte for each length, HTTP gets the same limit
+	if(address.user.length() > 255 || address.password.length() > 255)
+		return false;
+
 	address.port = htons(atoi(port.c_str()));
 	
-	ProxyPool::iterator it = m_proxyPool.find(set);
+	memset(&address.address, 0, sizeof(address.address));
+	address.address.sin_family = AF_INET;
+	address.address.sin_addr.s_addr = address.host;
+	address.address.sin_port = address.port;
 	
-	if(it == m_proxyPool.end())
-	{
-		ProxySet s;
+	address.health = NULL;
+	address.nextHop = NULL;
+	
+	return true;
+}
+
+bool ProxiedNetworkManager::addProxy(int set, string proxy, bool optimistic)
+{
+	vector<ProxyAddress> chain;
+	struct ProxyAddress address;
+	string::size_type start = 0, end;
+	
+	do {
+		end = proxy.find(',', start);
 		
-		s.proxies.push_back(address);
+		if(!parseProxy(proxy.substr(start, end == string::npos ? end : end - start), address))
+			return false;
 		
-		m_proxyPool[set] = s;
+		address.optimistic = optimistic;
+		chain.push_back(address);
+		
+		start = end + 1;
+	} while(end != string::npos);
+	
+	// link the later hops from the last one, only the first is chosen from the set
+	for(uint32_t i = chain.size() - 1; i > 0; --i) {
+		m_proxyHops.push_back(chain[i]);
+		chain[i - 1].nextHop = &m_proxyHops.back();
 	}
-	else
-		it->second.proxies.push_back(address);
 	
-	if(set != -1)
-		return addProxy(-1, proxy);
+	address = chain[0];
+	address.health = &m_proxyHealth[proxyKey(address)];
+	
+	// every proxy is in the default set as well
+	for(int target = set; ; target = -1)
+	{
+		ProxySet& proxySet = m_proxyPool[target];
 		
-	return true;
+		proxySet.id = target;
+		proxySet.proxies.push_back(address);
+		
+		if(target == m_currentSet)
+			m_activeSet = &proxySet;
+		
+		if(target == -1)
+			return true;
+	}
 }
 
 void ProxiedNetworkManager::clearProxies(void)
 {
+	closeWarmSessions();
 	m_proxyPool.clear();
+	m_proxyHops.clear();
+	m_activeSet = NULL;
 }
 
 bool ProxiedNetworkManager::usesProxies(void)
 {
-	return !m_proxyPool[m_currentSet].proxies.empty();
+	return m_activeSet && !m_activeSet->proxies.empty();
 }
 
 void ProxiedNetworkManager::activateSet(int set)
 {
-	if(m_proxyPool.find(set) != m_proxyPool.end())
+	ProxyPool::iterator it = m_proxyPool.find(set);
+	
+	// elements of an unordered_map stay where they are, whatever is added
+	if(it != m_proxyPool.end())
+	{
 		m_currentSet = set;
+		m_activeSet = &it->second;
+	}
+}
+
+void ProxiedNetworkManager::setSelection(int set, ProxySelection selection)
+{
+	ProxyPool::iterator it = m_proxyPool.find(set);
+	
+	if(it != m_proxyPool.end())
+		it->second.selection = selection;
+}
+
+
+void ProxiedNetworkManager::setWarmSessions(int set, uint32_t sessions)
+{
+	ProxyPool::iterator it = m_proxyPool.find(set);
+	
+	if(it == m_proxyPool.end())
+		return;
+	
+	it->second.warmSessions = sessions;
+	
+	// surplus sessions stay until taken or lost
+	replenishSessions(it->second);
+}
+
+void ProxiedNetworkManager::timeoutFired(Timeout timeout)
+{
+	m_warmTimer = TIMEOUT_EMPTY;
+	
+	for(ProxyPool::iterator it = m_proxyPool.begin(); it != m_proxyPool.end(); ++it)
+		replenishSessions(it->second);
+}
+
+void ProxiedNetworkManager::sessionReady(ProxiedTcpSocket * socket)
+{
+	ProxyPool::iterator it = m_proxyPool.find(socket->m_warmSet);
+	
+	if(it == m_proxyPool.end())
+		return;
+	
+	it->second.warming.remove(socket);
+	it->second.ready.push_back(socket);
+}
+
+void ProxiedNetworkManager::sessionLost(ProxiedTcpSocket * socket)
+{
+	ProxyPool::iterator it = m_proxyPool.find(socket->m_warmSet);
+	ProxySet * set;
+	
+	if(it == m_proxyPool.end())
+		return;
+	
+	set = &it->second;
+	
+	set->warming.remove(socket);
+	set->ready.remove(socket);
+	
+	// not from within the closing socket, and a dead proxy gets a breather
+	if(set->warming.size() + set->ready.size() < set->warmSessions && m_timeoutManager
+		&& m_warmTimer == TIMEOUT_EMPTY)
+	{
+		m_warmTimer = m_timeoutManager->scheduleTimeout(PROXY_WARM_RETRY, this);
+	}
+}
+
+ProxiedTcpSocket * ProxiedNetworkManager::takeWarmSession(ProxySet& set, const ProxyAddress& proxy)
+{
+	list<ProxiedTcpSocket *>::iterator session, fallback = set.ready.end();
+	ProxiedTcpSocket * socket = 0;
+	
+	// the longest ready first, before the proxy drops it for idling
+	for(session = set.ready.begin(); session != set.ready.end(); )
+	{
+		if((* session)->getProxy().health->isEjected())
+		{ // its proxy failed meanwhile, make room for a session elsewhere
+			ProxiedTcpSocket * ejected = * session;
+			
+			session = set.ready.erase(session);
+			ejected->m_warm = false;
+			ejected->close(true);
+			continue;
+		}
+		
+		// the chosen proxy's own session is preferred by any selection
+		if(proxyKey((* session)->getProxy()) == proxyKey(proxy))
+			break;
+		
+		if(set.selection != PROXY_AFFINITY && fallback == set.ready.end())
+			fallback = session;
+		
+		++session;
+	}
+	
+	if(session == set.ready.end())
+		session = fallback;
+	
+	if(session != set.ready.end())
+	{
+		socket = * session;
+		set.ready.erase(session);
+		socket->m_warm = false;
+	}
+	
+	replenishSessions(set);
+	return socket;
 }
 
+void ProxiedNetworkManager::replenishSessions(ProxySet& set)
+{
+	if(set.proxies.empty())
+		return;
+	
+	while(set.warming.size() + set.ready.size() < set.warmSessions)
+	{
+		ProxiedTcpSocket * socket = new ProxiedTcpSocket(this, 0, chooseProxy(set));
+		
+		socket->setNetworkManager(this);
+		socket->setHandshakeTimeout(m_handshakeTimeout);
+		
+		if(!socket->connectWarm(set.id))
+		{
+			socket->close(true);
+			break;
+		}
+		
+		set.warming.push_back(socket);
+	}
+}
 
-struct ProxyAddress ProxiedNetworkManager::getNextProxy()
+void ProxiedNetworkManager::closeWarmSessions()
 {
-	// just cycle through existing proxies
-	struct ProxyAddress next;
+	list<ProxiedTcpSocket *> warm;
 	
-	if(m_proxyPool[m_currentSet].nextProxy ==
-		m_proxyPool[m_currentSet].proxies.end())
+	// closing them counts them out, which must not start new ones
+	for(ProxyPool::iterator it = m_proxyPool.begin(); it != m_proxyPool.end(); ++it)
 	{
-		m_proxyPool[m_currentSet].nextProxy = m_proxyPool[m_currentSet]
-			.proxies.begin();
+		it->second.warmSessions = 0;
+		warm.insert(warm.end(), it->second.warming.begin(), it->second.warming.end());
+		warm.insert(warm.end(), it->second.ready.begin(), it->second.ready.end());
 	}
+	
+	for(list<ProxiedTcpSocket *>::iterator it = warm.begin(); it != warm.end(); ++it)
+		(* it)->close(true);
+}
 
-	next = * m_proxyPool[m_currentSet].nextProxy;
+
+//! Weight of the proxy for the target in rendezvous hashing.
+static uint64_t affinityScore(uint64_t target, uint64_t proxy)
+{
+	uint64_t score = target ^ (proxy * 0x9e3779b97f4a7c15ULL);
+	
+	// finalizer of splitmix64, spreads the proxies sharing most of their bits
+	score = (score ^ (score >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	score = (score ^ (score >> 27)) * 0x94d049bb133111ebULL;
 	
-	++m_proxyPool[m_currentSet].nextProxy;
+	return score ^ (score >> 31);
+}
 
-	return next;
+struct ProxyAddress ProxiedNetworkManager::getNextProxy(void)
+{
+	return chooseProxy(* m_activeSet);
+}
+
+struct ProxyAddress ProxiedNetworkManager::getNextProxy(const NetworkNode * remoteNode)
+{
+	// only affinity needs the target, anything else goes through the old hook
+	if(m_activeSet->selection != PROXY_AFFINITY)
+		return getNextProxy();
+	
+	return chooseProxy(* m_activeSet, remoteNode);
+}
+
+const struct ProxyAddress& ProxiedNetworkManager::chooseProxy(ProxySet& set, const NetworkNode * remoteNode)
+{
+	uint32_t count = set.proxies.size(), chosen = count;
+	
+	switch(set.selection)
+	{
+	case PROXY_AFFINITY:
+		if(remoteNode)
+		{
+			uint64_t target = 0xcbf29ce484222325ULL, best = 0;
+			
+			// FNV-1a of the host, the port does not matter to rate limits
+			for(string::const_iterator c = remoteNode->name.begin(); c != remoteNode->name.end(); ++c)
+				target = (target ^ (unsigned char) * c) * 0x100000001b3ULL;
+			
+			for(uint32_t i = 0; i < count; ++i)
+			{
+				uint64_t score;
+				
+				if(!isUsable(set.proxies[i]))
+					continue;
+				
+				score = affinityScore(target, proxyKey(set.proxies[i]));
+				
+				if(chosen == count || score > best)
+				{
+					chosen = i;
+					best = score;
+				}
+			}
+			
+			break;
+		}
+		
+		// warm sessions have no target yet, they spread over the proxies
+	case PROXY_ROUND_ROBIN:
+		for(uint32_t i = 0; i < count && chosen == count; ++i)
+		{
+			if(isUsable(set.proxies[set.nextProxy]))
+				chosen = set.nextProxy;
+			
+			if(++set.nextProxy == count)
+				set.nextProxy = 0;
+		}
+		
+		break;
+		
+	case PROXY_TWO_CHOICES:
+		{ // n == m is fine with few proxies
+			uint32_t first = nextRandom() % count, second = nextRandom() % count;
+			bool firstUsable = isUsable(set.proxies[first]), secondUsable = isUsable(set.proxies[second]);
+			
+			if(firstUsable && (!secondUsable
+				|| set.proxies[first].health->cost() <= set.proxies[second].health->cost()))
+			{
+				chosen = first;
+			}
+			else if(secondUsable)
+				chosen = second;
+			
+			if(chosen != count)
+				break;
+		}
+		
+		// both ejected, look for the healthy ones among all
+	case PROXY_LEAST_LATENCY:
+		for(uint32_t i = 0; i < count; ++i)
+		{
+			if(isUsable(set.proxies[i]) && (chosen == count
+				|| set.proxies[i].health->cost() < set.proxies[chosen].health->cost()))
+			{
+				chosen = i;
+			}
+		}
+		
+		break;
+	}
+	
+	if(chosen != count)
+		return set.proxies[chosen];
+	
+	// better a proxy that failed than none at all
+	chosen = 0;
+	
+	for(uint32_t i = 1; i < count; ++i)
+	{
+		if(set.proxies[i].health->ejectedUntil < set.proxies[chosen].health->ejectedUntil)
+			chosen = i;
+	}
+	
+	return set.proxies[chosen];
+}
+
+bool ProxiedNetworkManager::isUsable(const ProxyAddress& proxy)
+{
+	ProxyHealth * health = proxy.health;
+	
+	if(!health->isEjected())
+		return true;
+	
+	// its time is up, see whether it works again before we rely on it
+	if(!health->probing && ioTimeMillis() >= health->ejectedUntil)
+		probeProxy(proxy);
+	
+	return false;
+}
+
+void ProxiedNetworkManager::probeProxy(const ProxyAddress& proxy)
+{
+	ProxiedTcpSocket * socket = new ProxiedTcpSocket(this, 0, proxy, true);
+	// never asked for, the probe ends with the greeting
+	struct sockaddr_in address = proxy.address;
+	
+	socket->setNetworkManager(this);
+	socket->setHandshakeTimeout(m_handshakeTimeout);
+	
+	if(!socket->connect(&address))
+		socket->close(true);
+}
+
+
+void ProxiedNetworkManager::parkConnection(ProxiedTcpSocket * socket)
+{
+	m_idleConnections[proxyKey(socket->getProxy())].push_back(socket);
+}
+
+void ProxiedNetworkManager::unparkConnection(ProxiedTcpSocket * socket)
+{
+	map<uint64_t, list<ProxiedTcpSocket *> >::iterator it = m_idleConnections.find(proxyKey(socket->getProxy()));
+	
+	if(it == m_idleConnections.end())
+		return;
+	
+	it->second.remove(socket);
+	
+	if(it->second.empty())
+		m_idleConnections.erase(it);
+}
+
+ProxiedTcpSocket * ProxiedNetworkManager::takeIdleConnection(const ProxyAddress& proxy)
+{
+	map<uint64_t, list<ProxiedTcpSocket *> >::iterator it = m_idleConnections.find(proxyKey(proxy));
+	ProxiedTcpSocket * socket;
+	
+	if(it == m_idleConnections.end())
+		return 0;
+	
+	// the one idle for the shortest time is the least likely closed by the proxy
+	socket = it->second.back();
+	it->second.pop_back();
+	
+	if(it->second.empty())
+		m_idleConnections.erase(it);
+	
+	return socket;
 }
 
 
@@ -127,22 +552,41 @@ NetworkSocket * ProxiedNetworkManager::connectStream(const NetworkNode * remoteN
 {
 	if( proxy && usesProxies() )
 	{
-		struct sockaddr_in address;
 		ProxiedTcpSocket * socket;
+		ProxyAddress proxyAddress;
 
-		address.sin_family = AF_INET;
-		address.sin_port = htons(remoteNode->port);
-
-		if(inet_aton(remoteNode->name.c_str(), &address.sin_addr) == 0)
+		// names are sent to the proxy as they are, a SOCKS5 name has up to 255 bytes
+		if(remoteNode->name.empty() || remoteNode->name.length() > 255)
 			return 0;
 
-		socket = new ProxiedTcpSocket( this, localEndpoint, getNextProxy() );
-		
-		if(!socket->connect(&address))
+		proxyAddress = getNextProxy(remoteNode);
+
+		// a warm session only has to send the CONNECT
+		if((socket = takeWarmSession(* m_activeSet, proxyAddress)))
 		{
+			if(socket->reuse(localEndpoint, remoteNode))
+				return socket;
+
 			socket->close(true);
+		}
 
-			delete socket;
+		// an HTTP proxy connection left open saves the TCP handshake
+		if(proxyAddress.protocol == PROXY_HTTP_CONNECT && !proxyAddress.nextHop
+			&& (socket = takeIdleConnection(proxyAddress)))
+		{
+			if(socket->reuse(localEndpoint, remoteNode))
+				return socket;
+
+			socket->close(true);
+		}
+
+		socket = new ProxiedTcpSocket( this, localEndpoint, proxyAddress );
+		socket->setNetworkManager(this);
+		socket->setHandshakeTimeout(m_handshakeTimeout);
+		
+		if(!socket->connect(remoteNode))
+		{
+			socket->close(true);
 			return 0;
 		}
 
@@ -36,22 +36,20 @@ struct socks5_vidResponse {
 	uint8_t method;
 } __attribute__((__packed__));
 
+// followed by address and port
 struct socks5_rq {
 	uint8_t version; // == 5!
 	uint8_t command;
 	uint8_t rsv; // == 0!
-	uint8_t addressType; // XXX: only IPv4 (1) supported for now
-	uint32_t ipAddress;
-	uint16_t port;
+	uint8_t addressType; // IPv4 (1), domain name (3) or IPv6 (4)
 } __attribute__((__packed__));
 
+// followed by bound address and port
 struct socks5_rqResponse {
 	uint8_t version; // == 5!
 	uint8_t reply;
 	uint8_t rsv; // == 0!
 	uint8_t addressType;
-	uint32_t bndAddress;
-	uint16_t bndPort;
 } __attribute__((__packed__));
 
 struct socks5_userauthResponse {
@@ -82,8 +80,8 @@ ProxiedTcpSocket::ProxiedTcpSocket()
 {
 	m_useProxy = false;
 	m_proxyStatus = PROXY_NONE;
-	m_buffer = NULL;
 	m_bufferLength = 0;
+	m_remoteType = 0;
 
 	m_clientEndpoint = NULL;
 	m_finalClientEndpoint = NULL;
@@ -94,15 +92,38 @@ ProxiedTcpSocket::ProxiedTcpSocket()
 	m_serverSocket = false;
 	m_ioManager = 0;
 
+	memset(&m_proxy.address, 0, sizeof(m_proxy.address));
+	m_proxy.health = NULL;
+	m_proxy.protocol = PROXY_SOCKS5;
+	m_proxy.optimistic = false;
+	m_proxy.nextHop = NULL;
+	m_hops.push_back(m_proxy);
+	m_hop = 0;
+	m_hopsSent = 0;
+	m_probe = false;
+	m_handshakeFinished = true;
+	m_handshakeStarted = 0;
+	m_handshakeTimeout = 0;
+	m_handshakeTimer = TIMEOUT_EMPTY;
+	m_destroyed = NULL;
+
+	m_httpStatus = 0;
+	m_httpKeepAlive = false;
+	m_httpBodyKnown = false;
+	m_httpBodyLeft = 0;
+
+	m_warmSet = 0;
+	m_warm = false;
 }
 
-ProxiedTcpSocket::ProxiedTcpSocket(IOManager * ioManager, NetworkEndpoint * clientEndpoint, struct ProxyAddress proxy)
+ProxiedTcpSocket::ProxiedTcpSocket(IOManager * ioManager, NetworkEndpoint * clientEndpoint, struct ProxyAddress proxy,
+	bool probe)
 {
 	m_useProxy = true;
 	m_proxy = proxy;
 	m_proxyStatus = PROXY_NONE;
-	m_buffer = NULL;
 	m_bufferLength = 0;
+	m_remoteType = 0;
 
 	m_finalClientEndpoint = clientEndpoint;
 	m_clientEndpoint = this;
@@ -112,12 +133,41 @@ ProxiedTcpSocket::ProxiedTcpSocket(IOManager * ioManager, NetworkEndpoint * clie
 	m_state = NETSOCKSTATE_UNINITIALIZED;
 	m_serverSocket = false;
 	m_ioManager = ioManager;
+
+	// a probe is about the first proxy only
+	for(const struct ProxyAddress * hop = &proxy; hop; hop = probe ? NULL : hop->nextHop)
+		m_hops.push_back(*hop);
+
+	m_hop = 0;
+	m_hopsSent = 0;
+
+	m_probe = probe;
+	m_handshakeTimeout = 0;
+	m_handshakeTimer = TIMEOUT_EMPTY;
+	m_destroyed = NULL;
+
+	m_httpStatus = 0;
+	m_httpKeepAlive = false;
+	m_httpBodyKnown = false;
+	m_httpBodyLeft = 0;
+
+	m_warmSet = 0;
+	m_warm = false;
+
+	startHandshake();
 }
 
 ProxiedTcpSocket::~ProxiedTcpSocket(void)
 {
-	if(m_buffer)
-		free(m_buffer);
+	finishHandshake(HANDSHAKE_ABANDONED);
+
+	if(m_proxyStatus == PROXY_IDLE)
+		((ProxiedNetworkManager *) m_networkManager)->unparkConnection(this);
+	else if(m_warm)
+		((ProxiedNetworkManager *) m_networkManager)->sessionLost(this);
+
+	if(m_destroyed)
+		*m_destroyed = true;
 }
 
 bool ProxiedTcpSocket::connect(struct sockaddr_in * remoteHost)
@@ -127,223 +177,599 @@ bool ProxiedTcpSocket::connect(struct sockaddr_in * remoteHost)
 		
 	struct sockaddr_in sin;
 	
-	sin.sin_family = AF_INET;
-	sin.sin_addr.s_addr = m_proxy.host;
-	sin.sin_port = m_proxy.port;
+	sin = m_proxy.address;
 
 	if(m_useProxy) {
+		if(m_remoteName.empty()) {
+			m_remoteType = 1;
+			m_remoteName = inet_ntoa(remoteHost->sin_addr);
+		}
 		m_remoteHost = *remoteHost;
-		TcpSocket::connect( &sin );
+
+		if(!TcpSocket::connect( &sin )) {
+			finishHandshake(HANDSHAKE_FAILED);
+			return false;
+		}
+
+		if(m_handshakeTimeout && m_networkManager && m_networkManager->getTimeoutManager())
+			m_handshakeTimer = m_networkManager->getTimeoutManager()->scheduleTimeout(m_handshakeTimeout, this);
+
+		return true;
 	} else {
 		return TcpSocket::connect( remoteHost );
 	}
 }
 
-void ProxiedTcpSocket::pivotEndpoints(NetworkNode * proxyNode, char * buffer, uint32_t dataLength)
+bool ProxiedTcpSocket::connect(const NetworkNode * remoteNode)
+{
+	struct sockaddr_in sin;
+
+	if(!m_useProxy || m_state != NETSOCKSTATE_UNINITIALIZED || !setDestination(remoteNode))
+		return false;
+
+	sin = m_remoteHost;
+	return connect(&sin);
+}
+
+bool ProxiedTcpSocket::connectWarm(int set)
+{
+	struct sockaddr_in sin;
+
+	if(!m_useProxy || m_state != NETSOCKSTATE_UNINITIALIZED)
+		return false;
+
+	sin = m_proxy.address;
+
+	m_warmSet = set;
+	m_warm = true;
+
+	if(!TcpSocket::connect( &sin )) {
+		finishHandshake(HANDSHAKE_FAILED);
+		return false;
+	}
+
+	if(m_handshakeTimeout && m_networkManager && m_networkManager->getTimeoutManager())
+		m_handshakeTimer = m_networkManager->getTimeoutManager()->scheduleTimeout(m_handshakeTimeout, this);
+
+	return true;
+}
+
+bool ProxiedTcpSocket::reuse(NetworkEndpoint * clientEndpoint, const NetworkNode * remoteNode)
+{
+	if((m_proxyStatus != PROXY_IDLE && m_proxyStatus != PROXY_READY) || !setDestination(remoteNode))
+		return false;
+
+	m_finalClientEndpoint = clientEndpoint;
+	startHandshake();
+
+	if(m_handshakeTimeout && m_networkManager && m_networkManager->getTimeoutManager())
+		m_handshakeTimer = m_networkManager->getTimeoutManager()->scheduleTimeout(m_handshakeTimeout, this);
+
+	if(hop().protocol == PROXY_HTTP_CONNECT) {
+		m_hopsSent = m_hop;
+		expectHop();
+	} else {
+		char message[SOCKS5_REQUEST_MAX];
+
+		m_bufferLength = 0;
+		m_proxyStatus = PROXY_WAIT_CONN;
+		send(message, buildRequest(message, m_hop));
+	}
+
+	return true;
+}
+
+bool ProxiedTcpSocket::setDestination(const NetworkNode * remoteNode)
+{
+	memset(&m_remoteHost, 0, sizeof(m_remoteHost));
+	m_remoteHost.sin_family = AF_INET;
+	m_remoteHost.sin_port = htons(remoteNode->port);
+
+	if(inet_aton(remoteNode->name.c_str(), &m_remoteHost.sin_addr) != 0) {
+		m_remoteType = 1;
+	} else if(inet_pton(AF_INET6, remoteNode->name.c_str(), &m_remoteHost6) > 0) {
+		m_remoteType = 4;
+	} else if(!remoteNode->name.empty() && remoteNode->name.length() <= 255) {
+		// the name ends up in an HTTP request line, keep it a plain host name
+		for(string::const_iterator c = remoteNode->name.begin(); c != remoteNode->name.end(); ++c) {
+			if((unsigned char) *c <= ' ' || *c == 0x7f || *c == '/' || *c == '@' || *c == ':')
+				return false;
+		}
+
+		m_remoteType = 3;
+	} else {
+		return false;
+	}
+
+	m_remoteName = remoteNode->name;
+	return true;
+}
+
+bool ProxiedTcpSocket::close(bool force)
+{
+	// whatever happens from here on is not the proxy's fault
+	finishHandshake(HANDSHAKE_ABANDONED);
+
+	return TcpSocket::close(force);
+}
+
+void ProxiedTcpSocket::timeoutFired(Timeout timeout)
+{
+	if(timeout != m_handshakeTimer)
+	{
+		TcpSocket::timeoutFired(timeout);
+		return;
+	}
+
+	m_handshakeTimer = TIMEOUT_EMPTY;
+
+	finishHandshake(HANDSHAKE_FAILED);
+	close(true);
+}
+
+void ProxiedTcpSocket::startHandshake()
+{
+	m_handshakeFinished = false;
+	m_handshakeStarted = ioTimeMillis();
+
+	if(m_proxy.health)
+	{
+		if(m_probe)
+			m_proxy.health->probing = true;
+		else
+			++m_proxy.health->pending;
+	}
+}
+
+void ProxiedTcpSocket::finishHandshake(HandshakeOutcome outcome)
+{
+	ProxyHealth * health = m_proxy.health;
+
+	if(m_handshakeFinished)
+		return;
+
+	m_handshakeFinished = true;
+
+	// the chosen proxy did its part once a later hop answers
+	if(outcome == HANDSHAKE_FAILED && m_hop > 0)
+		outcome = HANDSHAKE_ABANDONED;
+
+	if(m_handshakeTimer != TIMEOUT_EMPTY)
+	{
+		m_networkManager->getTimeoutManager()->dropTimeout(m_handshakeTimer);
+		m_handshakeTimer = TIMEOUT_EMPTY;
+	}
+
+	if(!health)
+		return;
+
+	if(outcome == HANDSHAKE_SUCCEEDED)
+		health->succeeded(ioTimeMillis() - m_handshakeStarted);
+	else if(outcome == HANDSHAKE_FAILED)
+		health->failed(ioTimeMillis());
+
+	if(m_probe)
+		health->probing = false;
+	else
+		--health->pending;
+}
+
+void ProxiedTcpSocket::pivotEndpoints(NetworkNode * proxyNode, const char * buffer, uint32_t dataLength)
 {
 	NetworkNode remoteNode;
+	bool destroyed = false;
 
 	if(m_finalClientEndpoint) {
-		remoteNode.name = inet_ntoa(m_remoteHost.sin_addr);
+		remoteNode.name = m_remoteName;
 		remoteNode.port = ntohs(m_remoteHost.sin_port);
 		m_clientEndpoint = m_finalClientEndpoint;
 		m_finalClientEndpoint = NULL;
 
-		if(m_clientEndpoint) {
-			m_clientEndpoint->connectionEstablished( &remoteNode, proxyNode);
-			if(dataLength > 0)
-				m_clientEndpoint->dataRead(buffer, dataLength);
-		}
+		// the endpoint may well close us as soon as it hears of us
+		m_destroyed = &destroyed;
+		m_clientEndpoint->connectionEstablished( &remoteNode, proxyNode);
+
+		if(destroyed)
+			return;
+
+		m_destroyed = NULL;
+
+		if(dataLength > 0)
+			m_clientEndpoint->dataRead(buffer, dataLength);
 	}
 }
 
+uint32_t ProxiedTcpSocket::buildAuthentication(char * buffer, uint32_t index)
+{
+	const string& user = m_hops[index].user, & password = m_hops[index].password;
+	uint32_t ulen = user.length(), plen = password.length();
+
+	// version, user-length, user, password-length, password
+	buffer[0] = 1;
+	buffer[1] = ulen;
+	memcpy(buffer + 2, user.data(), ulen);
+	buffer[ulen + 2] = plen;
+	memcpy(buffer + ulen + 3, password.data(), plen);
+
+	return ulen + plen + 3;
+}
+
+uint32_t ProxiedTcpSocket::buildRequest(char * buffer, uint32_t index)
+{
+	struct socks5_rq rq;
+	uint32_t length = sizeof(rq);
+
+	rq.version = 5;
+	rq.command = 1;
+	rq.rsv = 0;
+
+	if(index + 1 < m_hops.size()) {
+		// through to the next proxy of the chain
+		rq.addressType = 1;
+		memcpy(buffer, &rq, sizeof(rq));
+		memcpy(buffer + length, &m_hops[index + 1].host, 4);
+		memcpy(buffer + length + 4, &m_hops[index + 1].port, 2);
+
+		return length + 4 + 2;
+	}
+
+	rq.addressType = m_remoteType;
+	memcpy(buffer, &rq, sizeof(rq));
+
+	switch(m_remoteType) {
+		case 1:
+			memcpy(buffer + length, &m_remoteHost.sin_addr, 4);
+			length += 4;
+			break;
+		case 3:
+			// the proxy resolves the name, saving us the lookup
+			buffer[length++] = m_remoteName.length();
+			memcpy(buffer + length, m_remoteName.data(), m_remoteName.length());
+			length += m_remoteName.length();
+			break;
+		case 4:
+			memcpy(buffer + length, &m_remoteHost6, 16);
+			length += 16;
+			break;
+	}
+
+	// m_remoteHost.sin_port is already in network byte order
+	memcpy(buffer + length, &m_remoteHost.sin_port, 2);
+	return length + 2;
+}
+
+bool ProxiedTcpSocket::sendOpening(uint32_t index)
+{
+	const struct ProxyAddress& proxy = m_hops[index];
+	char message[sizeof(struct socks5_vid) + SOCKS5_AUTH_MAX + SOCKS5_REQUEST_MAX];
+	struct socks5_vid vid;
+	uint32_t length;
+
+	if(proxy.protocol == PROXY_HTTP_CONNECT) {
+		if(!hasTarget(index))
+			return false;
+
+		sendHttpConnect(index);
+		return true;
+	}
+
+	if(proxy.optimistic && !m_probe) {
+		// offer the one method we know the proxy wants and do not wait for its choice
+		message[0] = 5;
+		message[1] = 1;
+		message[2] = proxy.user.empty() ? 0 : 2;
+		length = 3;
+
+		if(!proxy.user.empty())
+			length += buildAuthentication(message + length, index);
+
+		if(hasTarget(index))
+			length += buildRequest(message + length, index);
+
+		send(message, length);
+		return hasTarget(index);
+	}
+
+	vid.version = 5;
+	vid.nMethods = 2;
+	vid.method1 = 0; // no auth
+	vid.method2 = 2; // user+pass
+	send((char*) &vid, sizeof(struct socks5_vid));
+
+	return false;
+}
+
+void ProxiedTcpSocket::sendOpenings()
+{
+	bool complete;
+
+	// a hop gets its opening along with the request to reach it, if it may
+	do {
+		complete = sendOpening(m_hopsSent++);
+	} while(complete && m_hopsSent < m_hops.size() && m_hops[m_hopsSent].optimistic);
+}
+
+void ProxiedTcpSocket::expectHop()
+{
+	if(m_hopsSent <= m_hop)
+		sendOpenings();
+
+	if(hop().protocol == PROXY_SOCKS5) {
+		m_proxyStatus = PROXY_WAIT_VID;
+		return;
+	}
+
+	if(!hasTarget(m_hop)) {
+		authenticated(true);
+		return;
+	}
+
+	m_proxyStatus = PROXY_WAIT_HTTP;
+	m_bufferLength = 0;
+	m_httpStatus = 0;
+	m_httpKeepAlive = false;
+	m_httpBodyKnown = false;
+	m_httpBodyLeft = 0;
+}
+
+void ProxiedTcpSocket::authenticated(bool requestSent)
+{
+	char message[SOCKS5_REQUEST_MAX];
+
+	if(!hasTarget(m_hop)) {
+		// a warm session, the target comes with reuse
+		m_proxyStatus = PROXY_READY;
+		finishHandshake(HANDSHAKE_SUCCEEDED);
+		((ProxiedNetworkManager *) m_networkManager)->sessionReady(this);
+		return;
+	}
+
+	if(!requestSent)
+		send(message, buildRequest(message, m_hop));
+
+	m_proxyStatus = PROXY_WAIT_CONN;
+}
+
 void ProxiedTcpSocket::dataRead(const char * buffer, uint32_t dataLength)
 {
-	// append read data to buffer
-	if(m_buffer == NULL)
-		m_buffer = (char*)malloc(dataLength);
-	else
-		m_buffer = (char*)realloc(m_buffer, m_bufferLength + dataLength);
+	const char * input = buffer;
+	uint32_t inputLength = dataLength, buffered = m_bufferLength, consumed = 0;
+	char message[SOCKS5_AUTH_MAX];
 
-	memcpy(m_buffer + m_bufferLength, buffer, dataLength);
-	m_bufferLength += dataLength;
+	if(hop().protocol == PROXY_HTTP_CONNECT) {
+		httpDataRead(buffer, dataLength);
+		return;
+	}
 
+	// only a reply split across reads is copied, replies are parsed in place otherwise
+	if(buffered) {
+		uint32_t copied = sizeof(m_buffer) - buffered;
 
-	switch (m_proxyStatus) {
-		case PROXY_WAIT_VID:
-			if(m_bufferLength == sizeof(struct socks5_vidResponse)) {
-				struct socks5_vidResponse *vidR;
+		if(copied > dataLength)
+			copied = dataLength;
+
+		memcpy(m_buffer + buffered, buffer, copied);
+		input = m_buffer;
+		inputLength = buffered + copied;
+	}
+
+	// a pipelined handshake brings several replies in one read
+	for(;;) {
+		const char * data = input + consumed;
+		uint32_t available = inputLength - consumed;
+
+		switch (m_proxyStatus) {
+			case PROXY_WAIT_VID: {
+				const struct socks5_vidResponse *vidR = (const struct socks5_vidResponse*)data;
+
+				if(available < sizeof(struct socks5_vidResponse))
+					break;
+
+				consumed += sizeof(struct socks5_vidResponse);
 
-				vidR = (struct socks5_vidResponse*)m_buffer;
 				if(vidR->version != 5) {
+					finishHandshake(HANDSHAKE_FAILED);
 					close(true);
 					return;
 				}
+				if(m_probe && (vidR->method == 0 || vidR->method == 2)) {
+					// alive and willing, that is all a probe wants to know
+					finishHandshake(HANDSHAKE_SUCCEEDED);
+					close(true);
+					return;
+				}
+				if(hop().optimistic) {
+					// the rest was sent along with the greeting already
+					if(vidR->method != (hop().user.empty() ? 0 : 2)) {
+						finishHandshake(HANDSHAKE_FAILED);
+						close(true);
+						return;
+					}
+
+					if(vidR->method)
+						m_proxyStatus = PROXY_WAIT_USERAUTH;
+					else
+						authenticated(true);
+
+					continue;
+				}
 				switch(vidR->method) {
 					case 0:
 						// no authentication
-						m_proxyStatus = PROXY_SEND_CONN;
+						authenticated(false);
 						break;
 					case 2:
 						// user/password
-						//printf( "authenticating with \"%s:%s\"\n",
-						//		m_proxy.user.c_str(),
-						//		m_proxy.password.c_str() );
-						int ulen, plen;
-
-						ulen = m_proxy.user.length();
-						plen = m_proxy.password.length();
-						if(ulen == 0 || plen == 1) {
+						if(hop().user.empty()) {
+							finishHandshake(HANDSHAKE_FAILED);
 							close(true);
 							return;
-						} else {
-							char * buf;
-							buf = (char*)malloc(ulen + plen + 3);
-
-							// version
-							buf[0] = 1;
-							// user-length
-							buf[1] = ulen;
-							// user
-							memcpy(buf+2, m_proxy.user.c_str(), ulen);
-							// password-length
-							buf[ulen+2] = plen;
-							// password
-							memcpy(buf+ulen+3, m_proxy.password.c_str(), plen);
-
-							send(buf, ulen + plen + 3);
-							free( buf );
-							m_proxyStatus = PROXY_WAIT_USERAUTH;
-						};
+						}
+
+						send(message, buildAuthentication(message, m_hop));
+						m_proxyStatus = PROXY_WAIT_USERAUTH;
 						break;
 					default:
 						// unknown/unsupported
+						finishHandshake(HANDSHAKE_FAILED);
 						close(true);
 						return;
 				}
-				free(m_buffer);
-				m_buffer = NULL;
-				m_bufferLength = 0;
-			} else {
-				// simply wait for rest of data
-				if(m_bufferLength > sizeof(struct socks5_vid)) {
-					// bad socks server?!
-					close(true);
-					return;
-				}
+				continue;
 			}
-			break;
 
-		case PROXY_WAIT_USERAUTH:
-			if(m_bufferLength == sizeof(struct socks5_userauthResponse)) {
-				struct socks5_userauthResponse *uaR;
-				uaR = (struct socks5_userauthResponse*)buffer;
-				if(uaR->version != 1) {
-					close(true);
-					return;
-				}
-				if(uaR->status != 0) {
+			case PROXY_WAIT_USERAUTH: {
+				const struct socks5_userauthResponse *uaR = (const struct socks5_userauthResponse*)data;
+
+				if(available < sizeof(struct socks5_userauthResponse))
+					break;
+
+				consumed += sizeof(struct socks5_userauthResponse);
+
+				if(uaR->version != 1 || uaR->status != 0) {
+					finishHandshake(HANDSHAKE_FAILED);
 					close(true);
 					return;
-				} else {
-					// auth'd successfully. now send connect command
-					m_proxyStatus = PROXY_SEND_CONN;
 				}
-			} else {
-				if(m_bufferLength > sizeof(struct socks5_userauthResponse)) {
+
+				// auth'd successfully. now send connect command, unless it is on its way
+				authenticated(hop().optimistic);
+				continue;
+			}
+
+			case PROXY_READY:
+				// a warm session waits for its target, the proxy for its request
+				if(available) {
 					close(true);
 					return;
 				}
-			}
-			free(m_buffer);
-			m_buffer = NULL;
-			m_bufferLength = 0;
-			break;
+				break;
 
-		case PROXY_WAIT_CONN:
-			if(m_bufferLength >= sizeof(struct socks5_rqResponse)) {
-				struct socks5_rqResponse *rqR;
-				struct in_addr adr;
+			case PROXY_WAIT_CONN: {
+				const struct socks5_rqResponse *rqR = (const struct socks5_rqResponse*)data;
+				const char * bound = data + sizeof(struct socks5_rqResponse);
+				char name[INET6_ADDRSTRLEN];
 				NetworkNode localNode;
+				uint32_t length;
+				uint16_t port;
 
-				rqR = (struct socks5_rqResponse*)m_buffer;
+				if(available <= sizeof(struct socks5_rqResponse))
+					break;
+
+				// the bound address comes in any of the request's types
+				switch(rqR->addressType) {
+					case 1:
+						length = sizeof(struct socks5_rqResponse) + 4 + 2;
+						break;
+					case 3:
+						length = sizeof(struct socks5_rqResponse) + 1 + (uint8_t) bound[0] + 2;
+						break;
+					case 4:
+						length = sizeof(struct socks5_rqResponse) + 16 + 2;
+						break;
+					default:
+						finishHandshake(HANDSHAKE_FAILED);
+						close(true);
+						return;
+				}
+
+				if(available < length)
+					break;
 
 				if(rqR->version != 5) {
+					finishHandshake(HANDSHAKE_FAILED);
 					close(true);
 					return;
 				}
 				if(rqR->reply != 0) {
+					// only a general failure is the proxy's, not the target's
+					finishHandshake(rqR->reply == 1 ? HANDSHAKE_FAILED : HANDSHAKE_SUCCEEDED);
 					close(true);
 					return;
 				}
 
-				adr.s_addr = rqR->bndAddress;
-				localNode.name = inet_ntoa(adr);
-				localNode.port = ntohs(rqR->bndPort);
+				if(m_hop + 1 < m_hops.size()) {
+					// through to the next proxy, what follows is its
+					consumed += length - buffered;
+					m_bufferLength = 0;
+
+					++m_hop;
+					expectHop();
+
+					if(consumed < dataLength)
+						dataRead(buffer + consumed, dataLength - consumed);
+
+					return;
+				}
+
+				finishHandshake(HANDSHAKE_SUCCEEDED);
+
+				if(rqR->addressType == 3)
+					localNode.name = string(bound + 1, (uint8_t) bound[0]);
+				else if(inet_ntop(rqR->addressType == 1 ? AF_INET : AF_INET6, bound, name, sizeof(name)))
+					localNode.name = name;
+
+				memcpy(&port, data + length - 2, 2);
+				localNode.port = ntohs(port);
+
+				m_proxyStatus = PROXY_DONE;
 
-				pivotEndpoints(&localNode, m_buffer + sizeof(struct socks5_rqResponse),
-						m_bufferLength - sizeof(struct socks5_rqResponse));
+				// anything behind the reply is the target's already. the reply
+				// completes with this read, so the rest lies within buffer
+				consumed += length - buffered;
+				pivotEndpoints(&localNode, buffer + consumed, dataLength - consumed);
 
-				free(m_buffer);
-				m_buffer = NULL;
-				m_bufferLength = 0;
 				return;
-			} else {
-				// simply wait for rest of data
-				// special case: if more than sizeof(struct socks5_rqResponse):
-				//   this will be data from the new connection and needs to be
-				//   relayed to the final endpoint
 			}
-			break;
-		default:
-			close(true);
-			return;
-	}
 
-	if( m_proxyStatus == PROXY_SEND_CONN ) {
-		struct socks5_rq rq;
-		rq.version = 5;
-		rq.command = 1;
-		rq.rsv = 0;
-		rq.addressType = 1;
-		rq.ipAddress = m_remoteHost.sin_addr.s_addr;
-		// m_remoteHost.sin_port is already in network byte order
-		rq.port = m_remoteHost.sin_port;
-		send((char*)&rq, sizeof(rq));
-		m_proxyStatus = PROXY_WAIT_CONN;
+			default:
+				finishHandshake(HANDSHAKE_FAILED);
+				close(true);
+				return;
+		}
+
+		break;
 	}
+
+	// keep the start of the next reply, it is shorter than the buffer
+	m_bufferLength = inputLength - consumed;
+	memmove(m_buffer, input + consumed, m_bufferLength);
 }
 
 void ProxiedTcpSocket::connectionEstablished(NetworkNode * remoteNode, NetworkNode * localNode)
 {	
 	if( m_proxyStatus == PROXY_NONE ) {
-		struct socks5_vid vid;
-		vid.version = 5;
-		vid.nMethods = 2;
-		vid.method1 = 0; // no auth
-		vid.method2 = 2; // user+pass
-		send((char*) &vid, sizeof(struct socks5_vid));
-		m_proxyStatus = PROXY_WAIT_VID;
+		if(m_probe && hop().protocol == PROXY_HTTP_CONNECT) {
+			// nothing to ask an HTTP proxy without a target
+			finishHandshake(HANDSHAKE_SUCCEEDED);
+			close(true);
+			return;
+		}
+
+		expectHop();
 	} else {
+		finishHandshake(HANDSHAKE_FAILED);
 		close(true);
 		return;
 	};
 }
 
+// TcpSocket deletes itself after telling us, we only pass the news on
+
 void ProxiedTcpSocket::connectionClosed(void)
 {
+	finishHandshake(HANDSHAKE_FAILED);
+
 	if(m_finalClientEndpoint)
 		m_finalClientEndpoint->connectionClosed();
-
-	delete this;
 }
 
 void ProxiedTcpSocket::connectionLost(void)
 {
+	finishHandshake(HANDSHAKE_FAILED);
+
 	if(m_finalClientEndpoint)
 		m_finalClientEndpoint->connectionLost();
-
-	delete this;
 }
 
 
@@ -0,0 +1,79 @@
+/*
+ * RingBuffer.cpp - fixed capacity byte ring
+ * $Id$
+ *
+ * This code is distributed governed by the terms listed in the LICENSE file in
+ * the top directory of this source package.
+ *
+ * (c) 2009 by Georg 'oxff' Wicherski, <gw@mwcollect.org>
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <libnetworkd/Framing.hpp>
+
+
+namespace libnetworkd
+{
+
+
+RingBuffer::RingBuffer(uint32_t capacity)
+{
+	uint32_t size = 64;
+
+	while(size < capacity)
+		size <<= 1;
+
+	m_buffer = (char *) malloc(size);
+	m_mask = size - 1;
+
+	m_head = 0;
+	m_size = 0;
+}
+
+RingBuffer::~RingBuffer()
+{
+	free(m_buffer);
+}
+
+
+bool RingBuffer::write(const char * buffer, uint32_t length)
+{
+	uint32_t tail, toEnd;
+
+	if(length > available())
+		return false;
+
+	tail = (m_head + m_size) & m_mask;
+	toEnd = m_mask + 1 - tail;
+
+	if(length <= toEnd)
+		memcpy(m_buffer + tail, buffer, length);
+	else
+	{
+		memcpy(m_buffer + tail, buffer, toEnd);
+		memcpy(m_buffer, buffer + toEnd, length - toEnd);
+	}
+
+	m_size += length;
+	return true;
+}
+
+void RingBuffer::copy(uint32_t offset, char * buffer, uint32_t length)
+{
+	uint32_t position = (m_head + offset) & m_mask;
+	uint32_t toEnd = m_mask + 1 - position;
+
+	if(length <= toEnd)
+		memcpy(buffer, m_buffer + position, length);
+	else
+	{
+		memcpy(buffer, m_buffer + position, toEnd);
+		memcpy(buffer + toEnd, m_buffer, length - toEnd);
+	}
+}
+
+
+}
@@ -0,0 +1,687 @@
+/*
+ * SharedRingSocket.cpp - stream connections through shared memory
+ * $Id$
+ *
+ * This code is distributed governed by the terms listed in the LICENSE file in
+ * the top directory of this source package.
+ *
+ * (c) 2009 by Georg 'oxff' Wicherski, <gw@mwcollect.org>
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+#include <libnetworkd/Network.hpp>
+
+
+//! Smallest ring in bytes, also the granularity capacities are rounded to.
+#define SHARED_RING_MINIMUM 4096
+//! Largest ring in bytes, indices must not wrap within one ring.
+#define SHARED_RING_MAXIMUM (1 << 30)
+
+namespace libnetworkd
+{
+
+
+/**
+ * Endpoint of the UNIX domain socket a SharedRingSocket is negotiated over.
+ * The connecting side sends the memory and both doorbells along with
+ * "ring\n", the accepting side answers "ok\n" once it mapped them.
+ */
+class SharedRingControl : public NetworkEndpoint
+{
+public:
+	//! Connecting side, deletes itself once the socket is gone.
+	SharedRingControl()
+	{
+		m_networkManager = 0;
+		m_factory = 0;
+		m_socket = 0;
+		m_ring = 0;
+	}
+
+	//! Accepting side, created and destroyed by a SharedRingAcceptor.
+	SharedRingControl(NetworkManager * networkManager, NetworkEndpointFactory * factory,
+		UnixSocket * socket)
+	{
+		m_networkManager = networkManager;
+		m_factory = factory;
+		m_socket = socket;
+		m_ring = 0;
+	}
+
+	inline void setRing(SharedRingSocket * ring)
+	{ m_ring = ring; }
+
+	virtual void dataRead(const char * buffer, uint32_t dataLength)
+	{
+		if(m_factory || !m_ring)
+			return;
+
+		m_input.append(buffer, dataLength);
+
+		if(m_input.find("ok\n") != string::npos)
+			m_ring->establish();
+	}
+
+	virtual void descriptorsReceived(const int * descriptors, uint32_t count,
+		const char * buffer, uint32_t dataLength)
+	{
+		SharedRingSocket * ring;
+
+		if(!m_factory || m_ring || count != 3 || dataLength < 5 || memcmp(buffer, "ring\n", 5))
+		{
+			NetworkEndpoint::descriptorsReceived(descriptors, count, buffer, dataLength);
+			return;
+		}
+
+		ring = new SharedRingSocket(m_networkManager, m_factory);
+
+		if(!ring->attach(descriptors))
+		{
+			delete ring;
+			m_socket->close(true);
+
+			return;
+		}
+
+		m_ring = ring;
+		ring->setControl(m_socket, this);
+
+		m_socket->send("ok\n", 3);
+		ring->establish();
+	}
+
+	virtual void connectionClosed()
+	{ controlLost(); }
+
+	virtual void connectionLost()
+	{ controlLost(); }
+
+private:
+	void controlLost()
+	{
+		SharedRingSocket * ring = m_ring;
+		bool connecting = !m_factory;
+
+		m_ring = 0;
+
+		if(ring)
+			ring->controlLost();
+
+		// nobody else knows about us on the connecting side
+		if(connecting)
+			delete this;
+	}
+
+	NetworkManager * m_networkManager;
+	NetworkEndpointFactory * m_factory;
+	UnixSocket * m_socket;
+	SharedRingSocket * m_ring;
+
+	string m_input;
+};
+
+//! Factory of the listener of serverSharedRing.
+class SharedRingAcceptor : public NetworkEndpointFactory
+{
+public:
+	SharedRingAcceptor(NetworkManager * networkManager, NetworkEndpointFactory * factory)
+	{
+		m_networkManager = networkManager;
+		m_factory = factory;
+	}
+
+	virtual NetworkEndpoint * createEndpoint(NetworkSocket * clientSocket)
+	{ return new SharedRingControl(m_networkManager, m_factory, (UnixSocket *) clientSocket); }
+
+private:
+	NetworkManager * m_networkManager;
+	NetworkEndpointFactory * m_factory;
+};
+
+
+NetworkSocket * NetworkManager::connectSharedRing(const char * path, NetworkEndpoint * localEndpoint,
+	uint32_t capacity)
+{
+	SharedRingSocket * ring = new SharedRingSocket(this, localEndpoint);
+	SharedRingControl * control;
+	UnixSocket * socket;
+	int descriptors[3];
+
+	if(!ring->create(capacity, descriptors))
+	{
+		delete ring;
+		return 0;
+	}
+
+	control = new SharedRingControl();
+
+	if(!(socket = (UnixSocket *) connectUnix(path, control))
+		|| !socket->sendDescriptors(descriptors, 3, "ring\n", 5))
+	{ // closing the socket deletes the control endpoint
+		if(socket)
+			socket->close(true);
+
+		::close(descriptors[0]);
+		delete ring;
+
+		return 0;
+	}
+
+	// the peer holds the memory now, our mapping keeps it alive for us
+	::close(descriptors[0]);
+
+	control->setRing(ring);
+	ring->setControl(socket, control);
+
+	return ring;
+}
+
+NetworkSocket * NetworkManager::serverSharedRing(const char * path, NetworkEndpointFactory * factory,
+	uint8_t backlog)
+{
+	SharedRingAcceptor * acceptor = new SharedRingAcceptor(this, factory);
+	NetworkSocket * socket;
+
+	if(!(socket = serverUnix(path, acceptor, backlog)))
+	{
+		delete acceptor;
+		return 0;
+	}
+
+	m_sharedRingFactories.push_back(acceptor);
+	return socket;
+}
+
+
+SharedRingSocket::SharedRingSocket(NetworkManager * networkManager, NetworkEndpoint * clientEndpoint)
+{
+	m_networkManager = networkManager;
+	m_clientEndpoint = clientEndpoint;
+	m_serverEndpointFactory = 0;
+
+	initialize();
+}
+
+SharedRingSocket::SharedRingSocket(NetworkManager * networkManager, NetworkEndpointFactory * serverEndpointFactory)
+{
+	m_networkManager = networkManager;
+	m_clientEndpoint = 0;
+	m_serverEndpointFactory = serverEndpointFactory;
+
+	initialize();
+}
+
+SharedRingSocket::~SharedRingSocket()
+{
+	if(m_ioSocketState != IOSOCKSTAT_IGNORE)
+		m_networkManager->removeSocket(this);
+
+	if(m_memory)
+		munmap(m_memory, m_size);
+
+	if(m_doorbell >= 0)
+		::close(m_doorbell);
+
+	if(m_peerDoorbell >= 0)
+		::close(m_peerDoorbell);
+}
+
+void SharedRingSocket::initialize()
+{
+	m_state = NETSOCKSTATE_UNINITIALIZED;
+	m_ioSocketState = IOSOCKSTAT_IGNORE;
+
+	m_control = 0;
+	m_controlEndpoint = 0;
+
+	m_memory = 0;
+	m_size = 0;
+	m_capacity = 0;
+
+	m_transmit = m_receive = 0;
+	m_transmitData = m_receiveData = 0;
+
+	m_doorbell = -1;
+	m_peerDoorbell = -1;
+
+	m_destroyed = 0;
+}
+
+
+bool SharedRingSocket::create(uint32_t capacity, int * descriptors)
+{
+#if defined(HAVE_MEMFD_CREATE) && defined(HAVE_SYS_EVENTFD_H)
+	uint32_t size = SHARED_RING_MINIMUM;
+	int memory;
+
+	while(size < capacity && size < SHARED_RING_MAXIMUM)
+		size <<= 1;
+
+	if((memory = memfd_create("libnetworkd-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0)
+		return false;
+
+	if(ftruncate(memory, 2 * (sizeof(SharedRingHeader) + size)) != 0
+		#ifdef F_SEAL_SHRINK
+		|| fcntl(memory, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0
+		#endif
+		|| !mapMemory(memory, size, true))
+	{
+		::close(memory);
+		return false;
+	}
+
+	if((m_doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0
+		|| (m_peerDoorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+	{
+		::close(memory);
+		return false;
+	}
+
+	descriptors[0] = memory;
+	descriptors[1] = m_doorbell;
+	descriptors[2] = m_peerDoorbell;
+
+	m_networkManager->addSocket(this, m_doorbell);
+	m_ioSocketState = IOSOCKSTAT_IDLE;
+	m_state = NETSOCKSTATE_GOING_UP;
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool SharedRingSocket::attach(const int * descriptors)
+{
+	struct stat status;
+	uint32_t capacity;
+	bool mapped;
+	#ifdef F_SEAL_SHRINK
+	int seals;
+	#endif
+
+	// the doorbells are swapped from the point of view of the connecting side
+	m_doorbell = descriptors[2];
+	m_peerDoorbell = descriptors[1];
+
+	if(fstat(descriptors[0], &status) != 0
+		|| (uint64_t) status.st_size < 2 * (sizeof(SharedRingHeader) + SHARED_RING_MINIMUM)
+		|| (uint64_t) status.st_size > 2 * (sizeof(SharedRingHeader) + (uint64_t) SHARED_RING_MAXIMUM))
+	{
+		::close(descriptors[0]);
+		return false;
+	}
+
+	capacity = (status.st_size - 2 * sizeof(SharedRingHeader)) / 2;
+
+	#ifdef F_SEAL_SHRINK
+	// the peer must not be able to pull the memory from under us, nor to
+	// unseal it later; anything but a sealed memfd has no seals at all
+	seals = fcntl(descriptors[0], F_GET_SEALS);
+	#endif
+
+	if((capacity & (capacity - 1))
+		#ifdef F_SEAL_SHRINK
+		|| seals < 0
+		|| (seals & (F_SEAL_SHRINK | F_SEAL_SEAL)) != (F_SEAL_SHRINK | F_SEAL_SEAL)
+		#endif
+		)
+	{
+		::close(descriptors[0]);
+		return false;
+	}
+
+	mapped = mapMemory(descriptors[0], capacity, false);
+	::close(descriptors[0]);
+
+	if(!mapped
+		|| fcntl(m_doorbell, F_SETFL, fcntl(m_doorbell, F_GETFL) | O_NONBLOCK) != 0
+		|| fcntl(m_peerDoorbell, F_SETFL, fcntl(m_peerDoorbell, F_GETFL) | O_NONBLOCK) != 0)
+	{
+		return false;
+	}
+
+	m_clientEndpoint = m_serverEndpointFactory->createEndpoint(this);
+
+	m_networkManager->addSocket(this, m_doorbell);
+	m_ioSocketState = IOSOCKSTAT_IDLE;
+	m_state = NETSOCKSTATE_GOING_UP;
+
+	return true;
+}
+
+bool SharedRingSocket::mapMemory(int memory, uint32_t capacity, bool connecting)
+{
+	SharedRingHeader * headers;
+	char * data;
+
+	m_size = 2 * (sizeof(SharedRingHeader) + capacity);
+	m_memory = (char *) mmap(0, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, memory, 0);
+
+	if(m_memory == MAP_FAILED)
+	{
+		m_memory = 0;
+		return false;
+	}
+
+	m_capacity = capacity;
+
+	headers = (SharedRingHeader *) m_memory;
+	data = m_memory + 2 * sizeof(SharedRingHeader);
+
+	// the connecting side produces into the first ring
+	m_transmit = &headers[connecting ? 0 : 1];
+	m_receive = &headers[connecting ? 1 : 0];
+	m_transmitData = data + (connecting ? 0 : capacity);
+	m_receiveData = data + (connecting ? capacity : 0);
+
+	return true;
+}
+
+void SharedRingSocket::setControl(UnixSocket * control, SharedRingControl * endpoint)
+{
+	m_control = control;
+	m_controlEndpoint = endpoint;
+}
+
+
+void SharedRingSocket::establish()
+{
+	bool destroyed = false;
+
+	if(m_state != NETSOCKSTATE_GOING_UP)
+		return;
+
+	m_state = m_outputBuffer.empty() ? NETSOCKSTATE_IDLE : NETSOCKSTATE_BUFFERING;
+
+	m_destroyed = &destroyed;
+	m_clientEndpoint->connectionEstablished(0, 0);
+
+	if(destroyed)
+		return;
+
+	m_destroyed = 0;
+
+	// the peer might have produced before we ever went to sleep
+	drain();
+}
+
+void SharedRingSocket::controlLost()
+{
+	m_control = 0;
+	m_controlEndpoint = 0;
+
+	// whatever the peer produced before it went away is still ours
+	if(m_state == NETSOCKSTATE_GOING_UP || drain())
+		destroy(true);
+}
+
+
+void SharedRingSocket::send(const char * buffer, uint32_t length)
+{
+	uint32_t produced = 0;
+
+	if(m_state != NETSOCKSTATE_IDLE && m_state != NETSOCKSTATE_BUFFERING
+		&& m_state != NETSOCKSTATE_GOING_UP)
+	{
+		return;
+	}
+
+	if(m_outputBuffer.empty())
+		produced = produce(buffer, length);
+
+	if(produced == length)
+		return;
+
+	m_outputBuffer.append(buffer + produced, length - produced);
+
+	if(m_state == NETSOCKSTATE_IDLE)
+		m_state = NETSOCKSTATE_BUFFERING;
+
+	flush();
+}
+
+bool SharedRingSocket::close(bool force)
+{
+	if(!force && !m_outputBuffer.empty() && m_state != NETSOCKSTATE_GOING_UP)
+	{ // flush continues once the consumer made room
+		m_state = NETSOCKSTATE_GOING_DOWN;
+		return false;
+	}
+
+	if(m_transmit)
+	{ // the peer reads everything up to here before it sees the control socket go
+		__sync_synchronize();
+		m_transmit->closed = 1;
+		__sync_synchronize();
+
+		ring();
+	}
+
+	destroy(m_state == NETSOCKSTATE_BUFFERING || m_state == NETSOCKSTATE_GOING_DOWN);
+	return true;
+}
+
+NetworkSocketState SharedRingSocket::getState()
+{
+	return m_state;
+}
+
+
+void SharedRingSocket::pollRead()
+{
+	uint64_t rings;
+
+	// reset the doorbell before looking, the peer rings again for anything later
+	if(read(m_doorbell, &rings, sizeof(rings)) < 0 && errno != EAGAIN && errno != EINTR)
+	{
+		destroy(true);
+		return;
+	}
+
+	if(!flush() || m_state == NETSOCKSTATE_GOING_UP)
+		return;
+
+	drain();
+}
+
+void SharedRingSocket::pollWrite()
+{
+}
+
+void SharedRingSocket::pollError()
+{
+	destroy(true);
+}
+
+
+uint32_t SharedRingSocket::produce(const char * buffer, uint32_t length)
+{
+	uint32_t head = m_transmit->head, used = head - m_transmit->tail, offset, first;
+
+	// do not overwrite data before the consumer's tail is visible to us
+	__sync_synchronize();
+
+	if(used >= m_capacity)
+		return 0;
+
+	if(length > m_capacity - used)
+		length = m_capacity - used;
+
+	offset = head & (m_capacity - 1);
+	first = m_capacity - offset < length ? m_capacity - offset : length;
+
+	memcpy(m_transmitData + offset, buffer, first);
+	memcpy(m_transmitData, buffer + first, length - first);
+
+	// the data must be visible before the new head is
+	__sync_synchronize();
+	m_transmit->head = head + length;
+	__sync_synchronize();
+
+	if(m_transmit->waiting)
+	{
+		m_transmit->waiting = 0;
+		ring();
+	}
+
+	return length;
+}
+
+bool SharedRingSocket::flush()
+{
+	while(!m_outputBuffer.empty())
+	{
+		uint32_t produced = produce(m_outputBuffer.data(), m_outputBuffer.size());
+
+		if(produced)
+		{
+			m_outputBuffer.erase(0, produced);
+			continue;
+		}
+
+		// ask the consumer to ring once it made room, unless it just did
+		m_transmit->full = 1;
+		__sync_synchronize();
+
+		if(m_transmit->head - m_transmit->tail >= m_capacity)
+			return true;
+
+		m_transmit->full = 0;
+	}
+
+	if(m_state == NETSOCKSTATE_BUFFERING)
+		m_state = NETSOCKSTATE_IDLE;
+	else if(m_state == NETSOCKSTATE_GOING_DOWN)
+	{
+		close(true);
+		return false;
+	}
+
+	return true;
+}
+
+bool SharedRingSocket::drain()
+{
+	bool destroyed = false;
+
+	m_destroyed = &destroyed;
+
+	for(;;)
+	{
+		uint32_t tail = m_receive->tail, head = m_receive->head, offset, available;
+
+		__sync_synchronize();
+
+		if(head - tail > m_capacity)
+		{ // the peer scribbled over its indices
+			m_destroyed = 0;
+			destroy(true);
+
+			return false;
+		}
+
+		if(head == tail)
+		{
+			if(m_receive->closed)
+			{ // set after the last head, which we might not have seen yet
+				__sync_synchronize();
+
+				if(m_receive->head != tail)
+					continue;
+
+				m_destroyed = 0;
+				destroy(false);
+
+				return false;
+			}
+
+			// go to sleep, unless the producer was faster than us
+			m_receive->waiting = 1;
+			__sync_synchronize();
+
+			if(m_receive->head == tail)
+				break;
+
+			m_receive->waiting = 0;
+			continue;
+		}
+
+		offset = tail & (m_capacity - 1);
+		available = head - tail < m_capacity - offset ? head - tail : m_capacity - offset;
+
+		// straight from the shared memory, the producer keeps off until we advance
+		m_clientEndpoint->dataRead(m_receiveData + offset, available);
+
+		if(destroyed)
+			return false;
+
+		__sync_synchronize();
+		m_receive->tail = tail + available;
+		__sync_synchronize();
+
+		if(m_receive->full)
+		{
+			m_receive->full = 0;
+			ring();
+		}
+	}
+
+	m_destroyed = 0;
+	return true;
+}
+
+void SharedRingSocket::ring()
+{
+	uint64_t one = 1;
+
+	// a full counter means the peer is due to wake up anyway
+	if(write(m_peerDoorbell, &one, sizeof(one)) < 0)
+		return;
+}
+
+void SharedRingSocket::destroy(bool lost)
+{
+	if(m_destroyed)
+		* m_destroyed = true;
+
+	if(m_control)
+	{ // its endpoint must not report back to us
+		UnixSocket * control = m_control;
+
+		m_controlEndpoint->setRing(0);
+		m_control = 0;
+
+		control->close(true);
+	}
+
+	m_state = NETSOCKSTATE_DOWN;
+
+	if(m_clientEndpoint)
+	{
+		if(lost)
+			m_clientEndpoint->connectionLost();
+		else
+			m_clientEndpoint->connectionClosed();
+
+		if(m_serverEndpointFactory)
+			m_serverEndpointFactory->destroyEndpoint(m_clientEndpoint);
+	}
+
+	delete this;
+}
+
+
+}
@@ -12,18 +12,97 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include <new>
+
 #include <libnetworkd/Network.hpp>
 #include <libnetworkd/LogManager.hpp>
 
+
+//! Distinct object sizes (TcpSocket and derived classes) with an own pool.
+#define SOCKET_POOL_SLOTS 8
+
 namespace libnetworkd
 {
 
 
+//! Pools of the thread, reactors in several threads must not share free lists.
+//! They are never freed, not even when their thread ends.
+static __thread struct
+{
+	size_t objectSize;
+	MemoryPool * pool;
+} g_socketPools[SOCKET_POOL_SLOTS];
+
+static MemoryPool * socketPool(size_t size, bool create)
+{
+	for(unsigned int i = 0; i < SOCKET_POOL_SLOTS; ++i)
+	{
+		if(g_socketPools[i].objectSize == size)
+			return g_socketPools[i].pool;
+
+		if(!g_socketPools[i].pool)
+		{
+			if(!create)
+				return 0;
+
+			g_socketPools[i].objectSize = size;
+			return (g_socketPools[i].pool = new MemoryPool(size, 32));
+		}
+	}
+
+	return 0;
+}
+
+//! Put in front of every socket, tells where its memory came from.
+union SocketOrigin
+{
+	//! The pool of the allocating thread, NULL for the global allocator.
+	MemoryPool * pool;
+	char alignment[MEMORY_ALIGNMENT];
+};
+
+void * TcpSocket::operator new(size_t size)
+{
+	MemoryPool * pool = socketPool(size + sizeof(SocketOrigin), true);
+	SocketOrigin * origin;
+
+	if(!pool)
+		origin = (SocketOrigin *) ::operator new(size + sizeof(SocketOrigin));
+	else if(!(origin = (SocketOrigin *) pool->allocate()))
+		throw std::bad_alloc();
+
+	origin->pool = pool;
+	return origin + 1;
+}
+
+void TcpSocket::operator delete(void * object, size_t size)
+{
+	SocketOrigin * origin = (SocketOrigin *) object - 1;
+	MemoryPool * pool;
+
+	if(!object)
+		return;
+
+	if(!origin->pool)
+	{
+		::operator delete(origin);
+		return;
+	}
+
+	// the pools are never freed, so any thread's pool of the size may take
+	// the object; pool memory must never reach the global allocator, if this
+	// thread has no slot left for the size it is lost instead
+	if((pool = socketPool(size + sizeof(SocketOrigin), true)))
+		pool->release(origin);
+}
+
+
 TcpSocket::TcpSocket()
 {
 	m_socket = -1;
@@ -32,6 +111,17 @@ TcpSocket::TcpSocket()
 	m_state = NETSOCKSTATE_UNINITIALIZED;
 	m_serverSocket = false;
 	m_ioManager = 0;
+
+	m_networkManager = 0;
+	m_nextConnection = m_previousConnection = 0;
+
+	m_listenerLimit = m_subnetLimit = 0;
+	m_throttled = 0;
+	m_throttleTimeout = TIMEOUT_EMPTY;
+	m_lingerTimeout = TIMEOUT_EMPTY;
+
+	memset(&m_remoteAddress, 0, sizeof(m_remoteAddress));
+	resetStatistics();
 }
 
 TcpSocket::TcpSocket(IOManager * ioManager, NetworkEndpoint * clientEndpoint)
@@ -42,6 +132,17 @@ TcpSocket::TcpSocket(IOManager * ioManager, NetworkEndpoint * clientEndpoint)
 	m_serverEndpointFactory = 0;
 	m_state = NETSOCKSTATE_UNINITIALIZED;
 	m_serverSocket = false;
+
+	m_networkManager = 0;
+	m_nextConnection = m_previousConnection = 0;
+
+	m_listenerLimit = m_subnetLimit = 0;
+	m_throttled = 0;
+	m_throttleTimeout = TIMEOUT_EMPTY;
+	m_lingerTimeout = TIMEOUT_EMPTY;
+
+	memset(&m_remoteAddress, 0, sizeof(m_remoteAddress));
+	resetStatistics();
 }
 
 TcpSocket::TcpSocket(IOManager * ioManager, NetworkEndpointFactory * serverEndpointFactory)
@@ -53,18 +154,47 @@ TcpSocket::TcpSocket(IOManager * ioManager, NetworkEndpointFactory * serverEndpo
 	m_serverEndpointFactory = serverEndpointFactory;
 	m_serverSocket = false;
 	m_clientEndpoint = 0;
+
+	m_networkManager = 0;
+	m_nextConnection = m_previousConnection = 0;
+
+	m_listenerLimit = m_subnetLimit = 0;
+	m_throttled = 0;
+	m_throttleTimeout = TIMEOUT_EMPTY;
+	m_lingerTimeout = TIMEOUT_EMPTY;
+
+	memset(&m_remoteAddress, 0, sizeof(m_remoteAddress));
+	resetStatistics();
 }
 
 TcpSocket::TcpSocket(IOManager * ioManager, int existingSocket,
-		NetworkEndpointFactory * factory, struct sockaddr_in * remoteAddress)
+		NetworkEndpointFactory * factory, struct sockaddr_in * remoteAddress,
+		TcpSocket * listener)
 {
 	NetworkNode remoteNode, localNode;
 	m_ioManager = ioManager;
 	m_socket = existingSocket;
 	m_serverEndpointFactory = factory;
-	m_clientEndpoint = m_serverEndpointFactory->createEndpoint(this);
+	m_state = NETSOCKSTATE_UNINITIALIZED;
 	m_serverSocket = false;
 
+	m_networkManager = 0;
+	m_nextConnection = m_previousConnection = 0;
+
+	m_listenerLimit = m_subnetLimit = 0;
+	m_throttled = 0;
+	m_throttleTimeout = TIMEOUT_EMPTY;
+	m_lingerTimeout = TIMEOUT_EMPTY;
+
+	m_remoteAddress = * remoteAddress;
+	resetStatistics();
+
+	// link in before the endpoint gets a chance to close us again
+	inheritListener(listener);
+	attachSubnetLimit();
+
+	m_clientEndpoint = m_serverEndpointFactory->createEndpoint(this);
+
 	if(!m_clientEndpoint)
 	{
 		::close(existingSocket);
@@ -78,7 +208,7 @@ TcpSocket::TcpSocket(IOManager * ioManager, int existingSocket,
 		m_ioManager->addSocket(this, m_socket);
 		m_ioSocketState = IOSOCKSTAT_IDLE;
 
-		m_state = NETSOCKSTATE_IDLE;
+		setState(NETSOCKSTATE_IDLE);
 	}
 
 
@@ -107,6 +237,176 @@ TcpSocket::~TcpSocket()
 {
 	if(m_socket >= 0)
 		close();
+
+	if(m_lingerTimeout != TIMEOUT_EMPTY)
+		m_networkManager->getTimeoutManager()->dropTimeout(m_lingerTimeout);
+
+	releaseLimits();
+
+	if(m_networkManager)
+		m_networkManager->getConnectionTable()->remove(this);
+}
+
+
+void TcpSocket::setNetworkManager(NetworkManager * networkManager)
+{
+	if(m_networkManager)
+		m_networkManager->getConnectionTable()->remove(this);
+
+	if((m_networkManager = networkManager))
+		m_networkManager->getConnectionTable()->insert(this);
+}
+
+void TcpSocket::inheritListener(TcpSocket * listener)
+{
+	setNetworkManager(listener->m_networkManager);
+
+	if((m_listenerLimit = listener->m_listenerLimit))
+		++m_listenerLimit->references;
+}
+
+void TcpSocket::attachSubnetLimit()
+{
+	if(m_networkManager && !m_subnetLimit)
+		m_subnetLimit = m_networkManager->acquireSubnetLimit(&m_remoteAddress);
+}
+
+void TcpSocket::releaseLimits()
+{
+	if(m_throttleTimeout != TIMEOUT_EMPTY)
+	{
+		m_networkManager->getTimeoutManager()->dropTimeout(m_throttleTimeout);
+		m_throttleTimeout = TIMEOUT_EMPTY;
+	}
+
+	if(m_listenerLimit && !--m_listenerLimit->references)
+		delete m_listenerLimit;
+
+	if(m_subnetLimit)
+		m_networkManager->releaseSubnetLimit(&m_remoteAddress);
+
+	m_listenerLimit = m_subnetLimit = 0;
+}
+
+
+bool TcpSocket::setReadLimit(uint32_t rate, uint32_t burst)
+{
+	if(!m_networkManager || !m_networkManager->getTimeoutManager())
+		return false;
+
+	if(burst < rate)
+		burst = rate;
+
+	if(m_serverSocket)
+	{
+		if(!m_listenerLimit)
+			m_listenerLimit = new TrafficLimit;
+
+		m_listenerLimit->read.configure(rate, burst);
+	}
+	else
+		m_trafficLimit.read.configure(rate, burst);
+
+	return true;
+}
+
+bool TcpSocket::setWriteLimit(uint32_t rate, uint32_t burst)
+{
+	if(!m_networkManager || !m_networkManager->getTimeoutManager())
+		return false;
+
+	if(burst < rate)
+		burst = rate;
+
+	if(m_serverSocket)
+	{
+		if(!m_listenerLimit)
+			m_listenerLimit = new TrafficLimit;
+
+		m_listenerLimit->write.configure(rate, burst);
+	}
+	else
+		m_trafficLimit.write.configure(rate, burst);
+
+	return true;
+}
+
+uint32_t TcpSocket::allowance(bool write, uint32_t wanted)
+{
+	TrafficLimit * limits[] = { &m_trafficLimit, m_listenerLimit, m_subnetLimit };
+
+	for(unsigned int i = 0; i < sizeof(limits) / sizeof(* limits); ++i)
+	{
+		if(limits[i])
+		{
+			uint32_t available = write ? limits[i]->write.available()
+				: limits[i]->read.available();
+
+			if(available < wanted)
+				wanted = available;
+		}
+	}
+
+	return wanted;
+}
+
+void TcpSocket::consume(bool write, uint32_t length)
+{
+	TrafficLimit * limits[] = { &m_trafficLimit, m_listenerLimit, m_subnetLimit };
+
+	for(unsigned int i = 0; i < sizeof(limits) / sizeof(* limits); ++i)
+	{
+		if(limits[i])
+		{
+			if(write)
+				limits[i]->write.consume(length);
+			else
+				limits[i]->read.consume(length);
+		}
+	}
+}
+
+void TcpSocket::throttle(uint8_t direction)
+{
+	m_throttled |= direction;
+	updateInterest();
+
+	// all buckets refill at least one token per second
+	if(m_throttleTimeout == TIMEOUT_EMPTY)
+		m_throttleTimeout = m_networkManager->getTimeoutManager()->scheduleTimeout(1, this);
+}
+
+void TcpSocket::timeoutFired(Timeout timeout)
+{
+	if(timeout == m_lingerTimeout)
+	{ // peer did not close in time, give up
+		m_lingerTimeout = TIMEOUT_EMPTY;
+		finishLinger();
+
+		return;
+	}
+
+	ASSERT(timeout == m_throttleTimeout);
+
+	// just poll again, pollRead / pollWrite throttle once more if necessary
+	m_throttleTimeout = TIMEOUT_EMPTY;
+	m_throttled = 0;
+
+	if(m_state == NETSOCKSTATE_IDLE || m_state == NETSOCKSTATE_BUFFERING
+		|| m_state == NETSOCKSTATE_GOING_DOWN)
+	{
+		updateInterest();
+	}
+}
+
+
+void TcpSocket::resetStatistics()
+{
+	memset(&m_statistics, 0, sizeof(m_statistics));
+
+	m_statistics.created = ioTimeMillis();
+	m_statistics.stateChanged = m_statistics.created;
+	m_statistics.lastActivity = m_statistics.created;
 }
 
 
@@ -142,6 +442,9 @@ bool TcpSocket::connect(struct sockaddr_in * remoteHost)
 	if(m_state != NETSOCKSTATE_UNINITIALIZED)
 		return false;
 
+	m_remoteAddress = * remoteHost;
+	attachSubnetLimit();
+
 	if(m_socket == -1)
 		if(!socket())
 		{
@@ -179,7 +482,7 @@ bool TcpSocket::connect(struct sockaddr_in * remoteHost)
 		m_ioManager->addSocket(this, m_socket);
 		m_ioSocketState = IOSOCKSTAT_IDLE;
 
-		m_state = NETSOCKSTATE_IDLE;
+		setState(NETSOCKSTATE_IDLE);
 		m_clientEndpoint->connectionEstablished(&remoteNode, &localNode); // TODO give remote & local info
 
 		return true;
@@ -189,7 +492,7 @@ bool TcpSocket::connect(struct sockaddr_in * remoteHost)
 		m_ioManager->addSocket(this, m_socket);
 		m_ioSocketState = IOSOCKSTAT_BUFFERING;
 
-		m_state = NETSOCKSTATE_GOING_UP;
+		setState(NETSOCKSTATE_GOING_UP);
 
 		return true;
 	}
@@ -212,7 +515,7 @@ bool TcpSocket::listen(uint8_t backlog)
 		m_ioManager->addSocket(this, m_socket);
 		m_ioSocketState = IOSOCKSTAT_IDLE;
 
-		m_state = NETSOCKSTATE_IDLE;
+		setState(NETSOCKSTATE_IDLE);
 		m_serverSocket = true;
 
 		return true;
@@ -229,10 +532,19 @@ bool TcpSocket::close(bool force)
 		return true;
 	}
 
-	if(m_state == NETSOCKSTATE_BUFFERING && !force)
+	if(!force)
 	{
-		m_state = NETSOCKSTATE_GOING_DOWN;
-		return false;
+		if(m_state == NETSOCKSTATE_BUFFERING || m_state == NETSOCKSTATE_GOING_DOWN)
+		{ // pollWrite continues once the output is flushed
+			setState(NETSOCKSTATE_GOING_DOWN);
+			return false;
+		}
+
+		if(m_state == NETSOCKSTATE_LINGERING)
+			return true;
+
+		if(m_state == NETSOCKSTATE_IDLE && !m_serverSocket && linger())
+			return true;
 	}
 
 	if(m_ioManager)
@@ -249,7 +561,7 @@ bool TcpSocket::close(bool force)
 	}
 	
 	m_socket = -1;
-	m_state = NETSOCKSTATE_DOWN;
+	setState(NETSOCKSTATE_DOWN);
 	
 	if(!m_serverSocket && m_clientEndpoint && m_serverEndpointFactory)
 		m_serverEndpointFactory->destroyEndpoint(m_clientEndpoint);
@@ -259,6 +571,133 @@ bool TcpSocket::close(bool force)
 }
 
 
+bool TcpSocket::linger()
+{
+	TimeoutManager * timeoutManager;
+
+	if(!m_networkManager || !m_networkManager->getLingerTimeout()
+		|| !(timeoutManager = m_networkManager->getTimeoutManager()))
+	{
+		return false;
+	}
+
+	if(::shutdown(m_socket, SHUT_WR) != 0)
+		return false;
+
+	if(m_throttleTimeout != TIMEOUT_EMPTY)
+	{
+		timeoutManager->dropTimeout(m_throttleTimeout);
+		m_throttleTimeout = TIMEOUT_EMPTY;
+	}
+
+	// input is discarded from now on, regardless of any rate limits
+	m_throttled = 0;
+	m_ioSocketState = IOSOCKSTAT_IDLE;
+
+	setState(NETSOCKSTATE_LINGERING);
+	m_lingerTimeout = timeoutManager->scheduleTimeout(m_networkManager->getLingerTimeout(), this);
+
+	if(m_clientEndpoint)
+	{
+		m_clientEndpoint->connectionClosed();
+
+		if(m_serverEndpointFactory)
+			m_serverEndpointFactory->destroyEndpoint(m_clientEndpoint);
+
+		m_clientEndpoint = 0;
+	}
+
+	return true;
+}
+
+void TcpSocket::finishLinger()
+{
+	m_ioManager->removeSocket(this);
+
+	::close(m_socket);
+	m_socket = -1;
+
+	setState(NETSOCKSTATE_DOWN);
+	delete this;
+}
+
+
+bool TcpSocket::adopt(int connectedSocket)
+{
+	struct sockaddr_in localAddress, remoteAddress;
+	socklen_t localLen = sizeof(localAddress), remoteLen = sizeof(remoteAddress);
+	NetworkNode localNode, remoteNode;
+
+	if(m_state != NETSOCKSTATE_UNINITIALIZED || m_socket != -1)
+		return false;
+
+	if(getsockname(connectedSocket, (struct sockaddr *) &localAddress, &localLen) < 0
+		|| getpeername(connectedSocket, (struct sockaddr *) &remoteAddress, &remoteLen) < 0
+		|| fcntl(connectedSocket, F_SETFL, fcntl(connectedSocket, F_GETFL) | O_NONBLOCK) != 0)
+	{
+		return false;
+	}
+
+	m_socket = connectedSocket;
+
+	if(remoteAddress.sin_family == AF_INET)
+	{
+		m_remoteAddress = remoteAddress;
+		attachSubnetLimit();
+
+		localNode.name = inet_ntoa(localAddress.sin_addr);
+		localNode.port = ntohs(localAddress.sin_port);
+		remoteNode.name = inet_ntoa(remoteAddress.sin_addr);
+		remoteNode.port = ntohs(remoteAddress.sin_port);
+	}
+	else
+		localNode.port = remoteNode.port = 0;
+
+	m_ioManager->addSocket(this, m_socket);
+	m_ioSocketState = IOSOCKSTAT_IDLE;
+
+	setState(NETSOCKSTATE_IDLE);
+	m_clientEndpoint->connectionEstablished(&remoteNode, &localNode);
+
+	return true;
+}
+
+bool TcpSocket::adoptListener(int listeningSocket)
+{
+	if(m_state != NETSOCKSTATE_UNINITIALIZED || m_socket != -1
+		|| fcntl(listeningSocket, F_SETFL, fcntl(listeningSocket, F_GETFL) | O_NONBLOCK) != 0)
+	{
+		return false;
+	}
+
+	m_socket = listeningSocket;
+
+	m_ioManager->addSocket(this, m_socket);
+	m_ioSocketState = IOSOCKSTAT_IDLE;
+
+	setState(NETSOCKSTATE_IDLE);
+	m_serverSocket = true;
+
+	return true;
+}
+
+
+int TcpSocket::receive(char * buffer, uint32_t length)
+{
+	return ::recv(m_socket, buffer, length, 0);
+}
+
+int TcpSocket::transmit(const char * buffer, uint32_t length)
+{
+	return ::send(m_socket, buffer, length, MSG_NOSIGNAL);
+}
+
+void TcpSocket::deliver(const char * buffer, uint32_t length)
+{
+	m_clientEndpoint->dataRead(buffer, length);
+}
+
+
 NetworkSocketState TcpSocket::getState()
 {
 	return m_state;
@@ -269,43 +708,66 @@ void TcpSocket::send(const char * buffer, uint32_t length)
 {
 	if(m_state == NETSOCKSTATE_IDLE)
 	{
-		int sent;
+		uint32_t allowed = allowance(true, length);
+		int sent = 0;
 
-		if((uint32_t) (sent = ::send(m_socket, buffer, length, MSG_NOSIGNAL)) == length)
-			return;
-
-		if(sent <= 0)
+		if(allowed)
 		{
-			if(errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+			sent = transmit(buffer, allowed);
+			countSent(sent);
+
+			if(sent > 0)
+				consume(true, sent);
+
+			if((uint32_t) sent == length)
+				return;
+
+			if(sent <= 0)
 			{
-				m_state = NETSOCKSTATE_BUFFERING;
-				m_ioSocketState = IOSOCKSTAT_BUFFERING;
+				if(errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+					return; // TODO: check if not freeing data here creates a stale socket, actually, we should get some POLLERR but you never know
 
-				m_outputBuffer.append(buffer, length);
+				sent = 0;
 			}
-			
-			// TODO: check if not freeing data here creates a stale socket, actually, we should get some POLLERR but you never know
 		}
-		else
-		{
-			m_state = NETSOCKSTATE_BUFFERING;
-			m_ioSocketState = IOSOCKSTAT_BUFFERING;
 
-			m_outputBuffer.append(buffer + sent, length - sent);
-		}
+		setState(NETSOCKSTATE_BUFFERING);
+
+		m_outputBuffer.append(buffer + sent, length - sent);
+		countBuffered();
+
+		if((uint32_t) sent == allowed)
+			throttle(THROTTLE_WRITE);
+		else
+			updateInterest();
 	}
 	else if(m_state == NETSOCKSTATE_BUFFERING || m_state == NETSOCKSTATE_GOING_UP)
 	{
 		m_outputBuffer.append(buffer, length);
+		countBuffered();
 	}
 }
 
 
 void TcpSocket::pollRead()
 {
-	static char buffer[4096];
+	// per thread, reactors of different threads read at the same time
+	static __thread char buffer[4096];
+
+	ASSERT(m_state == NETSOCKSTATE_IDLE || m_state == NETSOCKSTATE_BUFFERING || m_state == NETSOCKSTATE_GOING_UP
+		|| m_state == NETSOCKSTATE_GOING_DOWN || m_state == NETSOCKSTATE_LINGERING);
+
+	if(m_state == NETSOCKSTATE_LINGERING)
+	{ // discard until the peer closes
+		int read = ::recv(m_socket, buffer, sizeof(buffer), 0);
+
+		countRead(read);
 
-	ASSERT(m_state == NETSOCKSTATE_IDLE || m_state == NETSOCKSTATE_BUFFERING || m_state == NETSOCKSTATE_GOING_UP);
+		if(read <= 0 && (!read || (errno != EAGAIN && errno != EINTR)))
+			finishLinger();
+
+		return;
+	}
 
 	if(m_serverSocket)
 	{ // server
@@ -313,15 +775,27 @@ void TcpSocket::pollRead()
 		socklen_t clientLen = sizeof(clientAddress);
 		int clientSocket = accept(m_socket, (struct sockaddr *) &clientAddress, &clientLen);
 
+		countRead(0);
+
 		if(clientSocket > 0)
-			new TcpSocket(m_ioManager, clientSocket, m_serverEndpointFactory, &clientAddress);
+			new TcpSocket(m_ioManager, clientSocket, m_serverEndpointFactory, &clientAddress, this);
 	}
 	else
 	{ // client
-		ASSERT(m_state == NETSOCKSTATE_IDLE || m_state == NETSOCKSTATE_BUFFERING);
+		ASSERT(m_state == NETSOCKSTATE_IDLE || m_state == NETSOCKSTATE_BUFFERING || m_state == NETSOCKSTATE_GOING_DOWN);
 
 		{
-			int read = ::recv(m_socket, buffer, sizeof(buffer), 0);
+			uint32_t allowed = allowance(false, sizeof(buffer));
+			int read;
+
+			if(!allowed)
+			{
+				throttle(THROTTLE_READ);
+				return;
+			}
+
+			read = receive(buffer, allowed);
+			countRead(read);
 
 			if(read <= 0)
 			{
@@ -345,13 +819,15 @@ void TcpSocket::pollRead()
 				return;
 			}
 
-			m_clientEndpoint->dataRead(buffer, read);
+			consume(false, read);
+			deliver(buffer, read);
 		}
 	}
 }
 
 void TcpSocket::pollWrite()
 {
+	uint32_t allowed;
 	int sent;
 
 	if(m_state == NETSOCKSTATE_GOING_UP)
@@ -382,15 +858,11 @@ void TcpSocket::pollWrite()
 		}
 
 		if(!m_outputBuffer.empty())
-		{
-			m_state = NETSOCKSTATE_BUFFERING;
-			m_ioSocketState = IOSOCKSTAT_BUFFERING;
-		}
+			setState(NETSOCKSTATE_BUFFERING);
 		else
-		{
-			m_state = NETSOCKSTATE_IDLE;
-			m_ioSocketState = IOSOCKSTAT_IDLE;
-		}
+			setState(NETSOCKSTATE_IDLE);
+
+		updateInterest();
 
 		// TODO provide local and remote node information
 		m_clientEndpoint->connectionEstablished(&remoteNode, &localNode);
@@ -399,7 +871,14 @@ void TcpSocket::pollWrite()
 
 	ASSERT(m_state == NETSOCKSTATE_BUFFERING || m_state == NETSOCKSTATE_GOING_DOWN);
 
-	sent = ::send(m_socket, m_outputBuffer.data(), m_outputBuffer.size(), MSG_NOSIGNAL);
+	if(!(allowed = allowance(true, m_outputBuffer.size())))
+	{
+		throttle(THROTTLE_WRITE);
+		return;
+	}
+
+	sent = transmit(m_outputBuffer.data(), allowed);
+	countSent(sent);
 
 	if(sent <= 0)
 	{
@@ -420,32 +899,36 @@ void TcpSocket::pollWrite()
 		return;
 	}
 
+	consume(true, sent);
 	m_outputBuffer.erase(0, sent);
 
 	if(m_outputBuffer.empty())
 	{
 		if(m_state == NETSOCKSTATE_GOING_DOWN)
 		{
-			m_state = NETSOCKSTATE_DOWN;
-			m_ioManager->removeSocket(this);
-			::close(m_socket);
+			setState(NETSOCKSTATE_IDLE);
 
-			if(!m_serverSocket && m_serverEndpointFactory)
-				m_serverEndpointFactory->destroyEndpoint(m_clientEndpoint);
-
-			m_clientEndpoint->connectionClosed();
-			delete this;
+			if(!linger())
+				close(true);
 		}
 		else
 		{
-			m_state = NETSOCKSTATE_IDLE;
-			m_ioSocketState = IOSOCKSTAT_IDLE;
+			setState(NETSOCKSTATE_IDLE);
+			updateInterest();
 		}
 	}
+	else if((uint32_t) sent == allowed)
+		throttle(THROTTLE_WRITE);
 }
 
 void TcpSocket::pollError()
 {
+	if(m_state == NETSOCKSTATE_LINGERING)
+	{
+		finishLinger();
+		return;
+	}
+
 	::close(m_socket);
 	m_socket = -1;
 
@@ -0,0 +1,61 @@
+/*
+ * TokenBucket.cpp - token bucket based traffic shaping
+ * $Id$
+ *
+ * This code is distributed governed by the terms listed in the LICENSE file in
+ * the top directory of this source package.
+ *
+ * (c) 2009 by Georg 'oxff' Wicherski, <gw@mwcollect.org>
+ *
+ */
+
+#include <libnetworkd/RateLimit.hpp>
+#include <libnetworkd/IO.hpp>
+
+
+namespace libnetworkd
+{
+
+
+TokenBucket::TokenBucket()
+{
+	m_rate = 0;
+	m_burst = 0;
+	m_tokens = 0;
+	m_updated = 0;
+}
+
+
+void TokenBucket::configure(uint32_t rate, uint32_t burst)
+{
+	m_rate = rate;
+	m_burst = burst;
+	m_tokens = burst;
+	m_updated = ioTimeMillis();
+}
+
+void TokenBucket::refill()
+{
+	uint64_t now = ioTimeMillis();
+	uint64_t tokens;
+
+	if(m_tokens >= m_burst)
+	{
+		m_updated = now;
+		return;
+	}
+
+	// keep fractions of a token for the next call by not advancing m_updated
+	if(!(tokens = (now - m_updated) * m_rate / 1000))
+		return;
+
+	m_updated = now;
+
+	if(tokens >= m_burst - m_tokens)
+		m_tokens = m_burst;
+	else
+		m_tokens += tokens;
+}
+
+
+}
@@ -10,27 +10,74 @@
  */
 
 #include <errno.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 
+#ifdef HAVE_LINUX_FILTER_H
+#include <linux/filter.h>
+#endif
+
 #include <libnetworkd/Network.hpp>
 #include <libnetworkd/LogManager.hpp>
 
+
+//! Larger datagrams are dropped on reception.
+#define UDP_DATAGRAM_SIZE 4096
+
+//! Size of a single receive slot if the kernel coalesces datagrams.
+#define UDP_COALESCED_SIZE 65536
+
+//! Upper bound of datagrams and payload sent as one offloaded message.
+#define UDP_OFFLOAD_SEGMENTS 64
+#define UDP_OFFLOAD_PAYLOAD 65507
+
+//! Total number of datagrams a single flush iteration hands to the kernel.
+#define UDP_FLUSH_DATAGRAMS 256
+
+#ifdef HAVE_SENDMMSG
+#define UDP_FLUSH_MESSAGES UDP_BATCH_SIZE
+#else
+#define UDP_FLUSH_MESSAGES 1
+#endif
+
 namespace libnetworkd
 {
 
 
+#if defined(HAVE_RECVMMSG) || defined(HAVE_SENDMMSG)
+typedef struct mmsghdr DatagramMessage;
+#else
+//! Layout of struct mmsghdr, messages are passed one by one then.
+struct DatagramMessage
+{
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+};
+#endif
+
+//! Room for one UDP_SEGMENT or UDP_GRO control message.
+union DatagramControl
+{
+	char buffer[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr align;
+};
+
+
 UdpSocketWrapper::~UdpSocketWrapper()
 {
 }
 
 void UdpSocketWrapper::send(const char * buffer, uint32_t length)
 {
-	m_parent->sendTo(buffer, length, m_node);
+	m_parent->sendTo(buffer, length, &m_address);
 }
 
 bool UdpSocketWrapper::close(bool force)
@@ -45,87 +92,761 @@ NetworkSocketState UdpSocketWrapper::getState()
 
 
 UdpSocket::UdpSocket(IOManager * ioManager, NetworkEndpointFactory * endpointFactory)
+	: m_peerPool(sizeof(UdpPeer))
 {
 	m_ioManager = ioManager;
 	m_serverEndpointFactory = endpointFactory;
-	
+	m_networkManager = 0;
+
 	m_socket = -1;
 	m_state = NETSOCKSTATE_UNINITIALIZED;
+	m_ioSocketState = IOSOCKSTAT_IGNORE;
+
+	m_batching = false;
+	m_sendOffload = false;
+	m_receiveOffload = false;
+	m_reusePort = false;
+
+	m_queue = 0;
+	m_queueSlots = UDP_QUEUE_SLOTS;
+	m_queueSlotSize = UDP_QUEUE_SLOT_SIZE;
+	m_queueHead = m_queueCount = 0;
+	m_dropPolicy = UDP_DROP_TAIL;
+	m_droppedDatagrams = 0;
+
+	m_newestPeer = m_oldestPeer = 0;
+	m_factoryPeers = 0;
+	m_maxPeers = 0;
+
+	m_timeoutManager = 0;
+	m_idleTimeout = 0;
+	m_expiryTimeout = TIMEOUT_EMPTY;
+	m_readTime = 0;
 }
 
 UdpSocket::~UdpSocket()
 {
+	if(m_expiryTimeout != TIMEOUT_EMPTY)
+		m_timeoutManager->dropTimeout(m_expiryTimeout);
+
+	if(m_socket >= 0)
+	{
+		m_ioManager->removeSocket(this);
+		::close(m_socket);
+	}
+
+	free(m_queue);
 }
 
 bool UdpSocket::socket()
-{	
+{
 	if(m_socket >= 0 || m_state != NETSOCKSTATE_UNINITIALIZED)
 		return false;
 
 	m_socket = ::socket(AF_INET, SOCK_DGRAM, 0);
-	
+
 	if(m_socket < 0)
 		return false;
-		
+
 	// TODO: check how this behaves with udp sockets
 	// if(setsockopt(m_socket, SOL_SOCKET, SO_REUSEADDR, &trueval, sizeof(trueval)) < 0)
 	//	return false;
-		
+
+	if(m_reusePort)
+	{
+		#ifdef SO_REUSEPORT
+		int trueval = 1;
+
+		if(setsockopt(m_socket, SOL_SOCKET, SO_REUSEPORT, &trueval, sizeof(trueval)) < 0)
+		#endif
+		{
+			::close(m_socket);
+			m_socket = -1;
+
+			return false;
+		}
+	}
+
 	return (fcntl(m_socket, F_SETFL, fcntl(m_socket, F_GETFL) | O_NONBLOCK) == 0);
 }
 
+bool UdpSocket::bind(sockaddr_in address)
+{
+	struct sockaddr_in localAddress;
+	socklen_t len = sizeof(localAddress);
+
+	if(!socket())
+		return false;
+
+	if(::bind(m_socket, (struct sockaddr *) &address, sizeof(address)) != 0
+		|| getsockname(m_socket, (struct sockaddr *) &localAddress, &len) != 0)
+	{
+		::close(m_socket);
+		m_socket = -1;
+
+		return false;
+	}
+
+	m_localAddress = localAddress;
+	m_localNode.name = inet_ntoa(localAddress.sin_addr);
+	m_localNode.port = ntohs(localAddress.sin_port);
+
+	m_ioManager->addSocket(this, m_socket);
+	m_ioSocketState = IOSOCKSTAT_IDLE;
+
+	m_state = NETSOCKSTATE_IDLE;
+	return true;
+}
+
+bool UdpSocket::close(bool force)
+{
+	if(m_state == NETSOCKSTATE_DOWN)
+		return true;
+
+	if(!force && m_queueCount)
+	{ // flush continues in pollWrite
+		m_state = NETSOCKSTATE_GOING_DOWN;
+		return false;
+	}
+
+	if(m_batching)
+	{ // pollRead is still iterating over our endpoints
+		m_state = NETSOCKSTATE_DOWN;
+		return true;
+	}
+
+	destroy();
+	return true;
+}
+
+void UdpSocket::destroy()
+{
+	m_state = NETSOCKSTATE_DOWN;
+
+	if(m_expiryTimeout != TIMEOUT_EMPTY)
+	{
+		m_timeoutManager->dropTimeout(m_expiryTimeout);
+		m_expiryTimeout = TIMEOUT_EMPTY;
+	}
+
+	// removal might move another peer into the same slot, check it again
+	for(uint32_t i = 0; i < m_clientEndpoints.getCapacity(); )
+	{
+		if(m_clientEndpoints.isUsed(i))
+			removePeer(m_clientEndpoints.valueAt(i), false);
+		else
+			++i;
+	}
+
+	if(m_networkManager)
+		m_networkManager->dropDatagramSocket(&m_localAddress, this);
+
+	if(m_socket >= 0)
+	{
+		m_ioManager->removeSocket(this);
+		::close(m_socket);
+
+		m_socket = -1;
+	}
+
+	delete this;
+}
+
+bool UdpSocket::setSendOffload(bool enable)
+{
+	#ifdef UDP_SEGMENT
+	int segment = 0;
+
+	if(m_socket < 0)
+		return false;
+
+	// the segment size is passed with every message, this just probes support
+	if(enable && setsockopt(m_socket, SOL_UDP, UDP_SEGMENT, &segment, sizeof(segment)) != 0)
+		return false;
+
+	m_sendOffload = enable;
+	return true;
+	#else
+	return !enable;
+	#endif
+}
+
+bool UdpSocket::setReceiveOffload(bool enable)
+{
+	#ifdef UDP_GRO
+	int value = enable;
+
+	if(m_socket < 0 || setsockopt(m_socket, SOL_UDP, UDP_GRO, &value, sizeof(value)) != 0)
+		return false;
+
+	m_receiveOffload = enable;
+	return true;
+	#else
+	return !enable;
+	#endif
+}
+
+
+bool UdpSocket::setIncomingCpu(int cpu)
+{
+	#ifdef SO_INCOMING_CPU
+	return m_socket >= 0 && setsockopt(m_socket, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) == 0;
+	#else
+	return false;
+	#endif
+}
+
+bool UdpSocket::steerByCpu(uint32_t shards)
+{
+	#if defined(HAVE_LINUX_FILTER_H) && defined(SO_ATTACH_REUSEPORT_CBPF)
+	// the returned value is the index of the socket within the group
+	struct sock_filter code[] = {
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t) (SKF_AD_OFF + SKF_AD_CPU) },
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, shards },
+		{ BPF_RET | BPF_A, 0, 0, 0 },
+	};
+	struct sock_fprog program;
+
+	if(m_socket < 0 || !shards)
+		return false;
+
+	program.len = sizeof(code) / sizeof(code[0]);
+	program.filter = code;
+
+	return setsockopt(m_socket, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) == 0;
+	#else
+	return false;
+	#endif
+}
+
+bool UdpSocket::setQueueLimits(uint32_t slots, uint32_t slotSize, UdpDropPolicy policy)
+{
+	if(m_queueCount || !slots)
+		return false;
+
+	// the ring is allocated again with the new geometry on demand
+	free(m_queue);
+	m_queue = 0;
+
+	m_queueSlots = slots;
+	m_queueSlotSize = slotSize;
+	m_queueHead = 0;
+	m_dropPolicy = policy;
+
+	return true;
+}
+
+
 UdpSocketWrapper * UdpSocket::addEndpoint(const NetworkNode& networkNode, NetworkEndpoint * endpoint)
 {
-	UdpSocketWrapper * wrapper = new UdpSocketWrapper(this, networkNode);
-	
-	m_clientEndpoints[networkNode] = std::pair<UdpSocketWrapper *, NetworkEndpoint *>(wrapper, endpoint);
-	return wrapper;
+	struct sockaddr_in address;
+	UdpPeer * peer;
+
+	address.sin_family = AF_INET;
+	address.sin_port = htons(networkNode.port);
+
+	if(inet_aton(networkNode.name.c_str(), &address.sin_addr) == 0)
+		return 0;
+
+	if(m_clientEndpoints.find(&address) || !(peer = (UdpPeer *) m_peerPool.allocate()))
+		return 0;
+
+	peer->wrapper = new UdpSocketWrapper(this, networkNode, address);
+	peer->endpoint = endpoint;
+	peer->fromFactory = false;
+	peer->newer = peer->older = 0;
+
+	m_clientEndpoints.insert(&address, peer);
+	return peer->wrapper;
 }
 
 bool UdpSocket::dropEndpoint(UdpSocketWrapper * wrapper, NetworkNode& remoteNode)
 {
-	map<NetworkNode, pair<UdpSocketWrapper *, NetworkEndpoint *>, NetworkNode>::iterator it;
-	
-	if((it = m_clientEndpoints.find(remoteNode)) == m_clientEndpoints.end())
+	struct sockaddr_in address;
+	UdpPeer ** entry;
+
+	if(wrapper)
+		address = * wrapper->getAddress();
+	else
+	{
+		address.sin_family = AF_INET;
+		address.sin_port = htons(remoteNode.port);
+
+		if(inet_aton(remoteNode.name.c_str(), &address.sin_addr) == 0)
+			return false;
+	}
+
+	if(!(entry = m_clientEndpoints.find(&address)))
 		return false;
-	
-	if(wrapper && wrapper != it->second.first)
+
+	if(wrapper && wrapper != (* entry)->wrapper)
+		return false;
+
+	// remoteNode might belong to the wrapper, do not touch it afterwards
+	removePeer(* entry, false);
+
+	// sockets of connectDatagram go away with their last endpoint
+	if(m_networkManager && !m_serverEndpointFactory && !m_clientEndpoints.getSize())
+		close();
+
+	return true;
+}
+
+void UdpSocket::removePeer(UdpPeer * peer, bool lost)
+{
+	m_clientEndpoints.remove(peer->wrapper->getAddress());
+
+	if(peer->fromFactory)
+	{
+		if(peer->newer)
+			peer->newer->older = peer->older;
+		else
+			m_newestPeer = peer->older;
+
+		if(peer->older)
+			peer->older->newer = peer->newer;
+		else
+			m_oldestPeer = peer->newer;
+
+		--m_factoryPeers;
+	}
+
+	if(lost)
+		peer->endpoint->connectionLost();
+	else
+		peer->endpoint->connectionClosed();
+
+	if(peer->fromFactory)
+		m_serverEndpointFactory->destroyEndpoint(peer->endpoint);
+
+	delete peer->wrapper;
+	m_peerPool.release(peer);
+}
+
+
+bool UdpSocket::setIdleTimeout(unsigned int idleTimeout)
+{
+	if(!m_networkManager || !(m_timeoutManager = m_networkManager->getTimeoutManager()))
 		return false;
-	
-	it->second.second->connectionClosed();
-	delete it->second.first;
-	m_clientEndpoints.erase(it);
-	
+
+	if(m_expiryTimeout != TIMEOUT_EMPTY)
+	{
+		m_timeoutManager->dropTimeout(m_expiryTimeout);
+		m_expiryTimeout = TIMEOUT_EMPTY;
+	}
+
+	m_idleTimeout = idleTimeout;
+	scheduleExpiry(time(0));
+
 	return true;
 }
 
+void UdpSocket::scheduleExpiry(time_t now)
+{
+	time_t expiry;
+
+	if(!m_idleTimeout || !m_oldestPeer || m_expiryTimeout != TIMEOUT_EMPTY)
+		return;
+
+	expiry = m_oldestPeer->lastActivity + m_idleTimeout;
+	m_expiryTimeout = m_timeoutManager->scheduleTimeout(expiry > now ? expiry - now : 0, this);
+}
+
+void UdpSocket::timeoutFired(Timeout timeout)
+{
+	time_t now = time(0);
+
+	ASSERT(timeout == m_expiryTimeout);
+	m_expiryTimeout = TIMEOUT_EMPTY;
+
+	// peers are ordered by activity, so only the expired ones are visited
+	m_batching = true;
+
+	while(m_oldestPeer && m_oldestPeer->lastActivity + (time_t) m_idleTimeout <= now
+		&& m_state != NETSOCKSTATE_DOWN)
+	{
+		removePeer(m_oldestPeer, true);
+	}
+
+	m_batching = false;
+
+	if(m_state == NETSOCKSTATE_DOWN)
+	{
+		destroy();
+		return;
+	}
+
+	scheduleExpiry(now);
+	flush();
+}
+
+
+void UdpSocket::datagramRead(const struct sockaddr_in * source, const char * buffer, uint32_t length)
+{
+	UdpPeer ** entry;
+	UdpPeer * peer;
+
+	if(!(entry = m_clientEndpoints.find(source)))
+	{
+		NetworkNode remoteNode, localNode = m_localNode;
+		UdpSocketWrapper * wrapper;
+
+		if(!m_serverEndpointFactory)
+			return;
+
+		if(m_maxPeers && m_factoryPeers >= m_maxPeers)
+			removePeer(m_oldestPeer, true);
+
+		if(!(peer = (UdpPeer *) m_peerPool.allocate()))
+			return;
+
+		remoteNode.name = inet_ntoa(source->sin_addr);
+		remoteNode.port = ntohs(source->sin_port);
+
+		peer->wrapper = wrapper = new UdpSocketWrapper(this, remoteNode, * source);
+		peer->fromFactory = true;
+
+		if(!(peer->endpoint = m_serverEndpointFactory->createEndpoint(peer->wrapper)))
+		{
+			delete peer->wrapper;
+			m_peerPool.release(peer);
+
+			return;
+		}
+
+		peer->lastActivity = m_readTime;
+		peer->newer = 0;
+
+		if((peer->older = m_newestPeer))
+			m_newestPeer->newer = peer;
+		else
+			m_oldestPeer = peer;
+
+		m_newestPeer = peer;
+		++m_factoryPeers;
+
+		m_clientEndpoints.insert(source, peer);
+		scheduleExpiry(m_readTime);
+
+		peer->endpoint->connectionEstablished(&remoteNode, &localNode);
+
+		// the endpoint might have dropped itself already
+		if(!(entry = m_clientEndpoints.find(source)) || (* entry)->wrapper != wrapper)
+			return;
+	}
+	else if((peer = * entry)->fromFactory && peer != m_newestPeer)
+	{ // move to the front of the activity list
+		peer->newer->older = peer->older;
+
+		if(peer->older)
+			peer->older->newer = peer->newer;
+		else
+			m_oldestPeer = peer->newer;
+
+		peer->newer = 0;
+		peer->older = m_newestPeer;
+		m_newestPeer->newer = peer;
+		m_newestPeer = peer;
+	}
+
+	peer = * entry;
+	peer->lastActivity = m_readTime;
+	peer->endpoint->dataRead(buffer, length);
+}
+
 
 void UdpSocket::pollRead()
 {
-	// TODO FIXME: implement
+	// coalesced receives use fewer but larger slots of the same memory; one
+	// batch per thread, for sharded reactors may receive at the same time
+	static __thread char buffers[UDP_BATCH_SIZE * UDP_DATAGRAM_SIZE];
+	static __thread struct sockaddr_in sources[UDP_BATCH_SIZE];
+	static __thread DatagramMessage messages[UDP_BATCH_SIZE];
+	static __thread struct iovec vectors[UDP_BATCH_SIZE];
+	static __thread DatagramControl controls[UDP_BATCH_SIZE];
+	uint32_t slotSize = m_receiveOffload ? UDP_COALESCED_SIZE : UDP_DATAGRAM_SIZE;
+	unsigned int slots = sizeof(buffers) / slotSize;
+	int received;
+
+	for(unsigned int i = 0; i < slots; ++i)
+	{
+		struct msghdr * header = &messages[i].msg_hdr;
+
+		vectors[i].iov_base = buffers + i * slotSize;
+		vectors[i].iov_len = slotSize;
+
+		memset(header, 0, sizeof(* header));
+		header->msg_name = &sources[i];
+		header->msg_namelen = sizeof(sources[i]);
+		header->msg_iov = &vectors[i];
+		header->msg_iovlen = 1;
+
+		if(m_receiveOffload)
+		{
+			header->msg_control = &controls[i];
+			header->msg_controllen = sizeof(controls[i]);
+		}
+	}
+
+	#ifdef HAVE_RECVMMSG
+	// MSG_TRUNC reports the real length of oversized datagrams
+	received = recvmmsg(m_socket, messages, slots, MSG_TRUNC, 0);
+	#else
+	for(received = 0; received < (int) slots; ++received)
+	{
+		int length = recvmsg(m_socket, &messages[received].msg_hdr, MSG_TRUNC);
+
+		if(length < 0)
+			break;
+
+		messages[received].msg_len = length;
+	}
+	#endif
+
+	if(received <= 0)
+		return;
+
+	m_batching = true;
+	m_readTime = time(0);
+
+	for(int i = 0; i < received && m_state != NETSOCKSTATE_DOWN; ++i)
+	{
+		const char * buffer = (const char *) vectors[i].iov_base;
+		uint32_t length = messages[i].msg_len, segment = length, offset = 0;
+
+		if(length > slotSize)
+			continue;
+
+		#ifdef UDP_GRO
+		for(struct cmsghdr * control = CMSG_FIRSTHDR(&messages[i].msg_hdr); control;
+			control = CMSG_NXTHDR(&messages[i].msg_hdr, control))
+		{
+			if(control->cmsg_level == SOL_UDP && control->cmsg_type == UDP_GRO)
+			{
+				int size;
+
+				memcpy(&size, CMSG_DATA(control), sizeof(size));
+
+				if(size > 0)
+					segment = size;
+			}
+		}
+		#endif
+
+		// split coalesced receives back into the original datagrams
+		do
+		{
+			datagramRead(&sources[i], buffer + offset,
+				length - offset < segment ? length - offset : segment);
+		} while((offset += segment) < length && m_state != NETSOCKSTATE_DOWN);
+	}
+
+	m_batching = false;
+
+	if(m_state == NETSOCKSTATE_DOWN)
+	{
+		destroy();
+		return;
+	}
+
+	flush();
 }
 
 void UdpSocket::pollWrite()
 {
-	// TODO FIXME: implement
+	flush();
 }
 
 void UdpSocket::pollError()
 {
-	// TODO FIXME: implement
+	int error;
+	socklen_t len = sizeof(error);
+
+	// errors of unconnected datagram sockets are not fatal, just clear it
+	getsockopt(m_socket, SOL_SOCKET, SO_ERROR, &error, &len);
 }
 
-bool UdpSocket::bind(sockaddr_in address)
+
+void UdpSocket::sendTo(const char * buffer, uint32_t length, const NetworkNode& target)
 {
-	// TODO FIXME: implement
-	return false;
+	struct sockaddr_in address;
+
+	address.sin_family = AF_INET;
+	address.sin_port = htons(target.port);
+
+	if(inet_aton(target.name.c_str(), &address.sin_addr) == 0)
+		return;
+
+	sendTo(buffer, length, &address);
 }
 
-void UdpSocket::sendTo(const char * buffer, uint32_t length, const NetworkNode& target)
+void UdpSocket::sendTo(const char * buffer, uint32_t length, const struct sockaddr_in * target)
 {
-	// TODO FIXME: implement
+	QueueSlot * slot;
+
+	if(m_state != NETSOCKSTATE_IDLE && m_state != NETSOCKSTATE_BUFFERING)
+		return;
+
+	if((!m_batching && !m_queueCount) || length > m_queueSlotSize)
+	{
+		if(sendto(m_socket, buffer, length, 0, (struct sockaddr *) target, sizeof(* target)) >= 0)
+			return;
+
+		// anything but a full buffer just drops this datagram
+		if(errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS)
+			return;
+
+		if(length > m_queueSlotSize)
+		{
+			++m_droppedDatagrams;
+			return;
+		}
+	}
+
+	if(!m_queue)
+	{
+		// keep payloads aligned for the copies
+		m_queueStride = (sizeof(QueueSlot) + m_queueSlotSize + 15) & ~15;
+
+		if(!(m_queue = (char *) malloc(m_queueSlots * m_queueStride)))
+		{
+			++m_droppedDatagrams;
+			return;
+		}
+	}
+
+	// a full ring while batching may just be waiting for the end of the
+	// batch, hand it to the kernel before giving up on anything
+	if(m_queueCount == m_queueSlots)
+		flush();
+
+	if(m_queueCount == m_queueSlots)
+	{
+		++m_droppedDatagrams;
+
+		if(m_dropPolicy == UDP_DROP_TAIL)
+			return;
+
+		dequeue(1);
+	}
+
+	slot = queueSlot(m_queueCount++);
+	slot->target = * target;
+	slot->length = length;
+	memcpy(slot + 1, buffer, length);
+
+	if(!m_batching)
+	{
+		m_state = NETSOCKSTATE_BUFFERING;
+		m_ioSocketState = IOSOCKSTAT_BUFFERING;
+	}
 }
 
+void UdpSocket::flush()
+{
+	while(m_queueCount)
+	{
+		DatagramMessage messages[UDP_FLUSH_MESSAGES];
+		DatagramControl controls[UDP_FLUSH_MESSAGES];
+		unsigned int segments[UDP_FLUSH_MESSAGES];
+		struct iovec vectors[UDP_FLUSH_DATAGRAMS];
+		unsigned int count, used = 0;
+		int sent;
+
+		for(count = 0; used < m_queueCount && count < UDP_FLUSH_MESSAGES
+			&& used < UDP_FLUSH_DATAGRAMS; ++count)
+		{
+			struct msghdr * header = &messages[count].msg_hdr;
+			QueueSlot * first = queueSlot(used), * slot;
+			uint32_t size = first->length, last, total = 0;
+
+			memset(header, 0, sizeof(* header));
+			header->msg_name = &first->target;
+			header->msg_namelen = sizeof(first->target);
+			header->msg_iov = &vectors[used];
+			segments[count] = 0;
+
+			// with offloading, a run of datagrams to the same target which
+			// are all of the same size, except for a shorter last one, is
+			// passed as one message and segmented by the kernel
+			do
+			{
+				slot = queueSlot(used);
+
+				vectors[used].iov_base = slot + 1;
+				vectors[used].iov_len = last = slot->length;
+
+				total += last;
+				++segments[count];
+				++used;
 
+				slot = queueSlot(used);
+			} while(m_sendOffload && used < m_queueCount && used < UDP_FLUSH_DATAGRAMS
+				&& segments[count] < UDP_OFFLOAD_SEGMENTS && last == size && size
+				&& slot->length <= size && total + slot->length <= UDP_OFFLOAD_PAYLOAD
+				&& slot->target.sin_addr.s_addr == first->target.sin_addr.s_addr
+				&& slot->target.sin_port == first->target.sin_port);
+
+			header->msg_iovlen = segments[count];
+
+			#ifdef UDP_SEGMENT
+			if(segments[count] > 1)
+			{
+				struct cmsghdr * control;
+				uint16_t segment = size;
+
+				header->msg_control = &controls[count];
+				header->msg_controllen = CMSG_SPACE(sizeof(segment));
+
+				control = CMSG_FIRSTHDR(header);
+				control->cmsg_level = SOL_UDP;
+				control->cmsg_type = UDP_SEGMENT;
+				control->cmsg_len = CMSG_LEN(sizeof(segment));
+				memcpy(CMSG_DATA(control), &segment, sizeof(segment));
+			}
+			#endif
+		}
+
+		#ifdef HAVE_SENDMMSG
+		sent = sendmmsg(m_socket, messages, count, 0);
+		#else
+		sent = sendmsg(m_socket, &messages[0].msg_hdr, 0) < 0 ? -1 : 1;
+		#endif
+
+		if(sent < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+				break;
+
+			if(segments[0] > 1)
+			{ // the kernel or device refused the offload, go on without
+				m_sendOffload = false;
+				continue;
+			}
+
+			// the first datagram is faulty, drop it and go on with the rest
+			sent = 1;
+		}
+
+		for(int i = 0; i < sent; ++i)
+			dequeue(segments[i]);
+	}
+
+	if(m_queueCount)
+	{
+		if(m_state == NETSOCKSTATE_IDLE)
+			m_state = NETSOCKSTATE_BUFFERING;
+
+		m_ioSocketState = IOSOCKSTAT_BUFFERING;
+	}
+	else if(m_state == NETSOCKSTATE_GOING_DOWN)
+		destroy();
+	else
+	{
+		m_state = NETSOCKSTATE_IDLE;
+		m_ioSocketState = IOSOCKSTAT_IDLE;
+	}
 }
 
+
+}
@@ -14,44 +14,116 @@
 #include <sys/un.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <libnetworkd/Network.hpp>
 
 
-#define UNIX_PATH_MAX 108
-
 namespace libnetworkd
 {
 
-UnixSocket::UnixSocket(IOManager * ioManager, NetworkEndpoint * clientEndpoint)
+//! Room for the control message of UNIX_MAX_DESCRIPTORS descriptors.
+union DescriptorControl
+{
+	char buffer[CMSG_SPACE(sizeof(int) * UNIX_MAX_DESCRIPTORS)];
+	struct cmsghdr align;
+};
+
+
+void NetworkEndpoint::descriptorsReceived(const int * descriptors, uint32_t count,
+	const char * buffer, uint32_t dataLength)
+{
+	for(uint32_t i = 0; i < count; ++i)
+		::close(descriptors[i]);
+
+	dataRead(buffer, dataLength);
+}
+
+
+UnixSocket::UnixSocket(IOManager * ioManager, NetworkEndpoint * clientEndpoint, int type)
 {
 	m_ioManager = ioManager;
 	m_clientEndpoint = clientEndpoint;
+
+	initialize(type);
 }
 
-UnixSocket::UnixSocket(IOManager * ioManager, NetworkEndpointFactory * serverEndpointFactory)
+UnixSocket::UnixSocket(IOManager * ioManager, NetworkEndpointFactory * serverEndpointFactory, int type)
 {
 	m_ioManager = ioManager;
 	m_serverEndpointFactory = serverEndpointFactory;
+
+	initialize(type);
 }
 
-UnixSocket::UnixSocket(IOManager * ioManager, int existingSocket, NetworkEndpointFactory * factory)
+UnixSocket::UnixSocket(IOManager * ioManager, int existingSocket, NetworkEndpointFactory * factory,
+	TcpSocket * listener)
 {
 	m_ioManager = ioManager;
 	m_socket = existingSocket;
 	m_serverEndpointFactory = factory;
+	
+	initialize(((UnixSocket *) listener)->m_type);
+	inheritListener(listener);
 	m_clientEndpoint = factory->createEndpoint(this);
 	
 	{
 		m_ioManager->addSocket(this, m_socket);
 		m_ioSocketState = IOSOCKSTAT_IDLE;
 		
-		m_state = NETSOCKSTATE_IDLE;
+		setState(NETSOCKSTATE_IDLE);
 	}
 	
 	m_clientEndpoint->connectionEstablished(0, 0);
 }
 
+UnixSocket::~UnixSocket()
+{
+	for(list<PendingDescriptors>::iterator it = m_pendingDescriptors.begin();
+		it != m_pendingDescriptors.end(); ++it)
+	{
+		for(uint32_t i = 0; i < it->count; ++i)
+			::close(it->descriptors[i]);
+	}
+
+	for(uint32_t i = 0; i < m_receivedCount; ++i)
+		::close(m_receivedDescriptors[i]);
+
+	delete[] m_message;
+}
+
+void UnixSocket::initialize(int type)
+{
+	m_type = type;
+	m_message = 0;
+
+	m_transmitted = 0;
+	m_receivedCount = 0;
+}
+
+
+socklen_t UnixSocket::makeAddress(struct sockaddr_un * address, const char * path)
+{
+	size_t length = strlen(path);
+
+	memset(address, 0, sizeof(* address));
+	address->sun_family = AF_UNIX;
+
+	if(length > sizeof(address->sun_path) - 1)
+		length = sizeof(address->sun_path) - 1;
+
+	memcpy(address->sun_path, path, length);
+
+	if(path[0] != '@')
+		return sizeof(* address);
+
+	// abstract names are not terminated, their length is that of the address
+	address->sun_path[0] = 0;
+	return offsetof(struct sockaddr_un, sun_path) + length;
+}
+
 
 bool UnixSocket::connect(const char * serverPath)
 {
@@ -62,16 +134,14 @@ bool UnixSocket::connect(const char * serverPath)
 		return false;
 	
 	struct sockaddr_un serverAddress;
-	
-	serverAddress.sun_family = AF_UNIX;
-	strncpy(serverAddress.sun_path, serverPath, UNIX_PATH_MAX);
+	socklen_t serverLen = makeAddress(&serverAddress, serverPath);
 		
-	if(::connect(m_socket, (struct sockaddr *) &serverAddress, sizeof(struct sockaddr_un)) == 0)
+	if(::connect(m_socket, (struct sockaddr *) &serverAddress, serverLen) == 0)
 	{
 		m_ioManager->addSocket(this, m_socket);
 		m_ioSocketState = IOSOCKSTAT_IDLE;
 		
-		m_state = NETSOCKSTATE_IDLE;
+		setState(NETSOCKSTATE_IDLE);
 		m_clientEndpoint->connectionEstablished(0, 0); // TODO give remote & local info
 		
 		return true;
@@ -81,7 +151,7 @@ bool UnixSocket::connect(const char * serverPath)
 		m_ioManager->addSocket(this, m_socket);
 		m_ioSocketState = IOSOCKSTAT_BUFFERING;
 		
-		m_state = NETSOCKSTATE_GOING_UP;
+		setState(NETSOCKSTATE_GOING_UP);
 		
 		return true;
 	}
@@ -92,14 +162,12 @@ bool UnixSocket::connect(const char * serverPath)
 bool UnixSocket::bind(const char * serverPath)
 {
 	struct sockaddr_un serverAddress;
-	
-	serverAddress.sun_family = AF_UNIX;
-	strncpy(serverAddress.sun_path, serverPath, UNIX_PATH_MAX);
+	socklen_t serverLen = makeAddress(&serverAddress, serverPath);
 	
 	if(!socket())
 		return false;
 	
-	return (::bind(m_socket, (struct sockaddr *) &serverAddress, sizeof(struct sockaddr_un)) == 0);
+	return (::bind(m_socket, (struct sockaddr *) &serverAddress, serverLen) == 0);
 }
 
 bool UnixSocket::socket()
@@ -109,7 +177,7 @@ bool UnixSocket::socket()
 	if(m_socket >= 0 || m_state != NETSOCKSTATE_UNINITIALIZED)
 		return false;
 
-	m_socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	m_socket = ::socket(AF_UNIX, m_type, 0);
 	
 	if(m_socket < 0)
 		return false;
@@ -128,9 +196,11 @@ void UnixSocket::pollRead()
 		socklen_t clientLen = sizeof(clientAddress);
 		int clientSocket = accept(m_socket, (struct sockaddr *) &clientAddress, &clientLen);
 		
+		countRead(0);
+		
 		if(clientSocket > 0)
 		{
-			new UnixSocket(m_ioManager, clientSocket, m_serverEndpointFactory);
+			new UnixSocket(m_ioManager, clientSocket, m_serverEndpointFactory, this);
 		}
 	}
 	else
@@ -138,5 +208,206 @@ void UnixSocket::pollRead()
 }
 
 
+
+void UnixSocket::send(const char * buffer, uint32_t length)
+{
+	if(m_type == SOCK_SEQPACKET)
+	{ // the peer could not tell an empty message from the end of the connection
+		if(!length || (m_state != NETSOCKSTATE_IDLE && m_state != NETSOCKSTATE_BUFFERING
+			&& m_state != NETSOCKSTATE_GOING_UP))
+		{
+			return;
+		}
+
+		m_messageLengths.push_back(length);
+	}
+
+	TcpSocket::send(buffer, length);
+}
+
+bool UnixSocket::sendDescriptors(const int * descriptors, uint32_t count,
+	const char * buffer, uint32_t length)
+{
+	PendingDescriptors pending;
+
+	if(!length || count > UNIX_MAX_DESCRIPTORS || m_serverSocket
+		|| (m_state != NETSOCKSTATE_IDLE && m_state != NETSOCKSTATE_BUFFERING
+		&& m_state != NETSOCKSTATE_GOING_UP))
+	{
+		return false;
+	}
+
+	// the descriptors belong to the first byte behind everything queued
+	pending.position = m_transmitted + m_outputBuffer.size();
+	pending.length = length;
+	pending.count = 0;
+
+	for(; pending.count < count; ++pending.count)
+	{
+		if((pending.descriptors[pending.count] = dup(descriptors[pending.count])) < 0)
+		{
+			while(pending.count--)
+				::close(pending.descriptors[pending.count]);
+
+			return false;
+		}
+	}
+
+	m_pendingDescriptors.push_back(pending);
+	send(buffer, length);
+
+	return true;
+}
+
+
+int UnixSocket::receive(char * buffer, uint32_t length)
+{
+	DescriptorControl control;
+	struct iovec vector;
+	struct msghdr header;
+	int read, flags = 0;
+
+	if(m_type == SOCK_SEQPACKET)
+	{ // a message is read whole or lost, so it may exceed the allowance
+		if(!m_message)
+			m_message = new char[UNIX_MAX_MESSAGE];
+
+		buffer = m_message;
+		length = UNIX_MAX_MESSAGE;
+	}
+
+	vector.iov_base = buffer;
+	vector.iov_len = length;
+
+	memset(&header, 0, sizeof(header));
+	header.msg_iov = &vector;
+	header.msg_iovlen = 1;
+	header.msg_control = &control;
+	header.msg_controllen = sizeof(control);
+
+	#ifdef MSG_CMSG_CLOEXEC
+	flags |= MSG_CMSG_CLOEXEC;
+	#endif
+
+	if((read = recvmsg(m_socket, &header, flags)) <= 0)
+		return read;
+
+	for(struct cmsghdr * message = CMSG_FIRSTHDR(&header); message;
+		message = CMSG_NXTHDR(&header, message))
+	{
+		uint32_t count;
+		const char * data;
+
+		if(message->cmsg_level != SOL_SOCKET || message->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		count = (message->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		data = (const char *) CMSG_DATA(message);
+
+		for(uint32_t i = 0; i < count; ++i)
+		{
+			int descriptor;
+
+			memcpy(&descriptor, data + i * sizeof(int), sizeof(int));
+
+			if(m_receivedCount < UNIX_MAX_DESCRIPTORS)
+				m_receivedDescriptors[m_receivedCount++] = descriptor;
+			else
+				::close(descriptor);
+		}
+	}
+
+	if(header.msg_flags & MSG_TRUNC)
+	{ // rather lose the connection than deliver half a message
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	return read;
+}
+
+int UnixSocket::transmit(const char * buffer, uint32_t length)
+{
+	PendingDescriptors * pending;
+	int sent;
+
+	// the output buffer starts with a message, which can only be sent whole
+	if(m_type == SOCK_SEQPACKET)
+		length = m_messageLengths.front();
+
+	if(m_pendingDescriptors.empty())
+		sent = ::send(m_socket, buffer, length, MSG_NOSIGNAL);
+	else if((pending = &m_pendingDescriptors.front())->position > m_transmitted)
+	{ // stop right before the data the descriptors are attached to
+		if(length > pending->position - m_transmitted)
+			length = pending->position - m_transmitted;
+
+		sent = ::send(m_socket, buffer, length, MSG_NOSIGNAL);
+	}
+	else
+	{
+		DescriptorControl control;
+		struct cmsghdr * message;
+		struct iovec vector;
+		struct msghdr header;
+
+		// nothing sent afterwards may share the message with the descriptors
+		vector.iov_base = (void *) buffer;
+		vector.iov_len = length < pending->length ? length : pending->length;
+
+		memset(&header, 0, sizeof(header));
+		header.msg_iov = &vector;
+		header.msg_iovlen = 1;
+		header.msg_control = &control;
+		header.msg_controllen = CMSG_SPACE(sizeof(int) * pending->count);
+
+		message = CMSG_FIRSTHDR(&header);
+		message->cmsg_level = SOL_SOCKET;
+		message->cmsg_type = SCM_RIGHTS;
+		message->cmsg_len = CMSG_LEN(sizeof(int) * pending->count);
+		memcpy(CMSG_DATA(message), pending->descriptors, sizeof(int) * pending->count);
+
+		if((sent = sendmsg(m_socket, &header, MSG_NOSIGNAL)) > 0)
+		{ // the peer holds its own references now
+			for(uint32_t i = 0; i < pending->count; ++i)
+				::close(pending->descriptors[i]);
+
+			m_pendingDescriptors.pop_front();
+		}
+	}
+
+	if(sent > 0)
+		m_transmitted += sent;
+
+	if(m_type == SOCK_SEQPACKET && (sent > 0
+		|| (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)))
+	{ // sent or given up along with the connection
+		m_messageLengths.pop_front();
+	}
+
+	return sent;
+}
+
+void UnixSocket::deliver(const char * buffer, uint32_t length)
+{
+	int descriptors[UNIX_MAX_DESCRIPTORS];
+	uint32_t count = m_receivedCount;
+
+	if(m_type == SOCK_SEQPACKET)
+		buffer = m_message;
+
+	if(!count)
+	{
+		m_clientEndpoint->dataRead(buffer, length);
+		return;
+	}
+
+	// the endpoint might close us, do not leave the descriptors behind
+	memcpy(descriptors, m_receivedDescriptors, sizeof(int) * count);
+	m_receivedCount = 0;
+
+	m_clientEndpoint->descriptorsReceived(descriptors, count, buffer, length);
+}
+
 }
 